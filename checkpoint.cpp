@@ -0,0 +1,167 @@
+#include "checkpoint.h"
+#include "config.h"
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#ifdef CAN_MMAP
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char checkpoint_magic[8] = {'F','L','U','T','C','K','P','1'};
+
+struct flutter::checkpoint_file::header {
+	char magic[8];
+	int32_t window;
+	int32_t reserved;
+};
+
+// followed by window frames of 9 doubles
+struct flutter::checkpoint_file::slot {
+	// zero while the slot is being written
+	uint64_t sequence;
+	int32_t frame_no;
+	int32_t count;
+	double prediction_error;
+	double filter_state[3];
+	double filter_cov[9];
+};
+
+flutter::checkpoint_file::checkpoint_file():
+	fd(-1),
+	data(0),
+	size(0),
+	window(0),
+	sequence(0)
+{
+}
+
+flutter::checkpoint_file::~checkpoint_file()
+{
+	close();
+}
+
+std::size_t flutter::checkpoint_file::slot_size() const
+{
+	return sizeof(slot) + window*9*sizeof(double);
+}
+
+flutter::checkpoint_file::slot* flutter::checkpoint_file::slot_at(int i) const
+{
+	return reinterpret_cast<slot*>(static_cast<char*>(data) +
+		sizeof(header) + i*slot_size());
+}
+
+#ifdef CAN_MMAP
+
+bool flutter::checkpoint_file::open(const std::string& file, int w)
+{
+	close();
+	fd = ::open(file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+	window = w;
+	std::size_t new_size = sizeof(header) + 2*slot_size();
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close();
+		return false;
+	}
+	// only a new or empty file is initialized, anything else must be a
+	// checkpoint of the same window and is left alone otherwise
+	if (st.st_size == 0) {
+		// the zeroed slots are not valid
+		if (ftruncate(fd, new_size) != 0) {
+			close();
+			return false;
+		}
+	} else {
+		header h;
+		if (static_cast<std::size_t>(st.st_size) != new_size ||
+				pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+				std::memcmp(h.magic, checkpoint_magic,
+					sizeof(checkpoint_magic)) != 0 ||
+				h.window != window) {
+			close();
+			return false;
+		}
+	}
+	void* p = mmap(0, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	data = p;
+	size = new_size;
+	header* h = static_cast<header*>(data);
+	std::memcpy(h->magic, checkpoint_magic, sizeof(checkpoint_magic));
+	h->window = window;
+	sequence = std::max(slot_at(0)->sequence, slot_at(1)->sequence);
+	return true;
+}
+
+void flutter::checkpoint_file::close()
+{
+	if (data)
+		munmap(data, size);
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	data = 0;
+	size = 0;
+	window = 0;
+	sequence = 0;
+}
+
+#else
+
+bool flutter::checkpoint_file::open(const std::string&, int)
+{
+	return false;
+}
+
+void flutter::checkpoint_file::close()
+{
+}
+
+#endif
+
+bool flutter::checkpoint_file::load(checkpoint_state& s) const
+{
+	if (!data || !sequence)
+		return false;
+	const slot* p = slot_at(sequence % 2);
+	if (p->sequence != sequence || p->count < 0 || p->count > window)
+		return false;
+	s.frame_no = p->frame_no;
+	s.prediction_error = p->prediction_error;
+	std::copy(p->filter_state, p->filter_state + 3, s.filter_state);
+	std::copy(p->filter_cov, p->filter_cov + 9, s.filter_cov);
+	s.frames.resize(p->count);
+	const double* f = reinterpret_cast<const double*>(p + 1);
+	for (int i = 0; i < p->count; ++i)
+		std::copy(f + 9*i, f + 9*(i+1), s.frames[i].begin());
+	return true;
+}
+
+void flutter::checkpoint_file::save(const checkpoint_state& s)
+{
+	if (!data)
+		return;
+	slot* p = slot_at((sequence + 1) % 2);
+	p->sequence = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	int count = std::min(static_cast<int>(s.frames.size()), window);
+	p->frame_no = s.frame_no;
+	p->count = count;
+	p->prediction_error = s.prediction_error;
+	std::copy(s.filter_state, s.filter_state + 3, p->filter_state);
+	std::copy(s.filter_cov, s.filter_cov + 9, p->filter_cov);
+	double* f = reinterpret_cast<double*>(p + 1);
+	for (int i = 0; i < count; ++i)
+		std::copy(s.frames[i].begin(), s.frames[i].end(), f + 9*i);
+	std::atomic_thread_fence(std::memory_order_release);
+	p->sequence = ++sequence;
+}
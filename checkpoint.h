@@ -0,0 +1,62 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace flutter {
+
+// Everything needed to continue the trajectory of a run.
+struct checkpoint_state {
+	int frame_no;
+	double prediction_error;
+	// Kalman filter state and error covariance after the last correction
+	double filter_state[3];
+	double filter_cov[9];
+	// sensor, camera and apparent (x, y, a) of the queued frames, the
+	// newest first
+	std::vector<std::array<double, 9>> frames;
+};
+
+// A memory-mapped file holding the latest checkpoint_state. The state is
+// written alternately to two slots and a slot is marked valid by its
+// sequence number only after it has been written completely, so the file
+// always holds a complete state even if the process dies while saving.
+struct checkpoint_file {
+	struct header;
+	struct slot;
+
+	int fd;
+	void* data;
+	std::size_t size;
+	int window;
+	uint64_t sequence;
+
+	checkpoint_file();
+	~checkpoint_file();
+	checkpoint_file(const checkpoint_file&) = delete;
+	checkpoint_file& operator=(const checkpoint_file&) = delete;
+
+	// Opens or creates the file for states of at most window frames.
+	// Returns false without changing the file if it is neither empty nor
+	// a checkpoint for the same window, and if the file cannot be mapped
+	// or mapping is not supported.
+	bool open(const std::string& file, int window);
+	bool is_open() const
+	{
+		return data != 0;
+	}
+	// Reads the latest complete state, returns false if there is none.
+	bool load(checkpoint_state& s) const;
+	void save(const checkpoint_state& s);
+	void close();
+	std::size_t slot_size() const;
+	slot* slot_at(int i) const;
+};
+
+}
+
+#endif // CHECKPOINT_H
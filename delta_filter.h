@@ -0,0 +1,38 @@
+#ifndef DELTA_FILTER_H
+#define DELTA_FILTER_H
+
+#include <opencv2/opencv.hpp>
+#include <cmath>
+
+namespace flutter {
+
+// Sets up a Kalman filter over the frame to frame deltas (x, y, a). The
+// errors are relative to the frame dimensions and a full turn.
+template <typename T>
+void init_delta_filter(cv::KalmanFilter& filter, cv::Size size,
+	double process_error, double measurement_error)
+{
+	setIdentity(filter.transitionMatrix);
+	setIdentity(filter.measurementMatrix);
+	double perr2 = process_error*process_error;
+	double merr2 = measurement_error*measurement_error;
+	filter.processNoiseCov = (cv::Mat_<T>(3,3) <<
+		size.width*size.width*perr2,   0, 0, 0,
+		size.height*size.height*perr2, 0, 0, 0,
+		4*M_PI*M_PI*perr2);
+	filter.measurementNoiseCov = (cv::Mat_<T>(3,3) <<
+		size.width*size.width*merr2,   0, 0, 0,
+		size.height*size.height*merr2, 0, 0, 0,
+		4*M_PI*M_PI*merr2);
+}
+
+// Weight of the low-pass filter for a step of the given number of frame
+// periods, so that it decays at the same rate in time.
+inline double low_pass_weight(double low_pass, double periods)
+{
+	return periods == 1 ? low_pass : 1 - std::pow(1 - low_pass, periods);
+}
+
+}
+
+#endif // DELTA_FILTER_H
@@ -0,0 +1,105 @@
+#include "downscale.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace cv;
+
+// BT.601 luma weights of blue, green and red in 1/256
+static const unsigned WEIGHT_B = 29, WEIGHT_G = 150, WEIGHT_R = 77;
+// source rows whose 8-bit values fit into 16-bit sums
+static const int MAX_ROWS = 65535/255;
+
+// Adds the n bytes of a source row to the 16-bit column sums, 16 at a time
+// where SSE2 or NEON is available.
+static void add_row(const uchar* s, ushort* sum, int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; x + 16 <= n; x += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + x));
+		__m128i* p = reinterpret_cast<__m128i*>(sum + x);
+		_mm_storeu_si128(p, _mm_add_epi16(_mm_loadu_si128(p),
+			_mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128(p + 1, _mm_add_epi16(_mm_loadu_si128(p + 1),
+			_mm_unpackhi_epi8(v, zero)));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 16 <= n; x += 16) {
+		uint8x16_t v = vld1q_u8(s + x);
+		vst1q_u16(sum + x, vaddw_u8(vld1q_u16(sum + x), vget_low_u8(v)));
+		vst1q_u16(sum + x + 8,
+			vaddw_u8(vld1q_u16(sum + x + 8), vget_high_u8(v)));
+	}
+#endif
+	for (; x < n; ++x)
+		sum[x] += s[x];
+}
+
+// The source rows of each destination row are first summed per column
+// with SIMD, then the columns are weighted and binned, so that the scalar
+// part only sees one row per destination row.
+void flutter::downscale_gray(const Mat& src, Mat& dst, Size size,
+	task_pool* pool)
+{
+	CV_Assert(src.depth() == CV_8U &&
+		(src.channels() == 1 || src.channels() == 3));
+	CV_Assert(size.width > 0 && size.height > 0 &&
+		size.width <= src.cols && size.height <= src.rows);
+	dst.create(size, CV_8UC1);
+	int cn = src.channels();
+	int n = src.cols*cn;
+	// first source column of each destination column
+	std::vector<int> x0(size.width + 1);
+	for (int j = 0; j <= size.width; ++j)
+		x0[j] = j*src.cols/size.width;
+
+	auto row = [&](int i) {
+		int y0 = i*src.rows/size.height;
+		int y1 = (i+1)*src.rows/size.height;
+		AutoBuffer<unsigned> acc(size.width);
+		AutoBuffer<ushort> sum(n);
+		for (int j = 0; j < size.width; ++j)
+			acc[j] = 0;
+		for (int y = y0; y < y1; y += MAX_ROWS) {
+			for (int x = 0; x < n; ++x)
+				sum[x] = 0;
+			for (int k = y; k < y1 && k < y + MAX_ROWS; ++k)
+				add_row(src.ptr<uchar>(k), &sum[0], n);
+			const ushort* s = &sum[0];
+			if (cn == 3) {
+				for (int j = 0; j < size.width; ++j) {
+					unsigned b = 0, g = 0, r = 0;
+					for (int x = 3*x0[j]; x < 3*x0[j+1]; x += 3) {
+						b += s[x];
+						g += s[x+1];
+						r += s[x+2];
+					}
+					acc[j] += WEIGHT_B*b + WEIGHT_G*g + WEIGHT_R*r;
+				}
+			} else {
+				for (int j = 0; j < size.width; ++j) {
+					unsigned v = 0;
+					for (int x = x0[j]; x < x0[j+1]; ++x)
+						v += s[x];
+					acc[j] += 256*v;
+				}
+			}
+		}
+		uchar* d = dst.ptr<uchar>(i);
+		for (int j = 0; j < size.width; ++j) {
+			unsigned n = 256*(x0[j+1] - x0[j])*(y1 - y0);
+			d[j] = static_cast<uchar>((acc[j] + n/2)/n);
+		}
+	};
+	if (pool && pool->size() > 1)
+		pool->parallel_for(size.height, row);
+	else
+		for (int i = 0; i < size.height; ++i)
+			row(i);
+}
@@ -0,0 +1,18 @@
+#ifndef DOWNSCALE_H
+#define DOWNSCALE_H
+
+#include "task_pool.h"
+#include <opencv2/opencv.hpp>
+
+namespace flutter {
+
+// Converts an 8-bit BGR or gray image to gray and reduces it to size by
+// averaging the source pixels of each destination pixel, in one pass over
+// the source. The size must not be larger than the source. Rows are split
+// over the pool if given.
+void downscale_gray(const cv::Mat& src, cv::Mat& dst, cv::Size size,
+	task_pool* pool = 0);
+
+}
+
+#endif // DOWNSCALE_H
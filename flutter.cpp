@@ -1,29 +1,31 @@
 #include "options.h"
 #include "options_io.h"
 #include "transform.h"
+#include "trajectory.h"
 #include "registration.h"
+#include "registration_cache.h"
+#include "phase_correlation.h"
+#include "warp.h"
+#include "delta_filter.h"
+#include "sweep.h"
+#include "checkpoint.h"
+#include "mat_pool.h"
+#include "motion_vectors.h"
+#include "raw_video.h"
+#include "shm_ring.h"
+#include "scheduler.h"
+#include "gui_pump.h"
+#include "quality.h"
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <fstream>
 #include <memory>
 #include <deque>
-
-typedef double t_type;
-
-template <typename T>
-struct opencv_traits {};
-
-template <>
-struct opencv_traits<float>
-{
-	static constexpr int type = CV_32FC1;
-};
-
-template <>
-struct opencv_traits<double>
-{
-	static constexpr int type = CV_64FC1;
-};
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <thread>
 
 using namespace std;
 using namespace cv;
@@ -31,107 +33,541 @@ using namespace cv;
 namespace flutter {
 
 static char const* const program_name = "flutter";
+static constexpr char delim = '\t';
 
+template <typename T>
 struct frame {
+	// number of the frame in the input, -1 for padding
+	int input_no;
+	// capture time in ms
+	double timestamp;
 	Mat image;
-	Transform<t_type> sensor;
-	Transform<t_type> camera;
-	Transform<t_type> apparent;
+	// the image as PNG while it is waiting to be displayed
+	vector<uchar> compressed;
+	Transform<T> sensor;
+	Transform<T> camera;
+	Transform<T> apparent;
+	// codec motion vectors from the previous frame, if any
+	Mat motion_src;
+	Mat motion_dst;
 
+	frame():
+		input_no(-1),
+		timestamp(0.0)
+	{
+	}
 	void copyTo(frame& f) const;
+	void compress();
+	void decompress();
+	void release();
 };
 
-void frame::copyTo(frame& f) const
+template <typename T>
+void frame<T>::copyTo(frame& f) const
 {
 	image.copyTo(f.image);
 	f.camera = camera;
 	f.apparent = apparent;
 }
 
+template <typename T>
+void frame<T>::compress()
+{
+	if (image.empty())
+		return;
+	vector<int> params = { CV_IMWRITE_PNG_COMPRESSION, 1 };
+	imencode(".png", image, compressed, params);
+	image.release();
+}
+
+template <typename T>
+void frame<T>::decompress()
+{
+	if (compressed.empty())
+		return;
+	image = imdecode(compressed, CV_LOAD_IMAGE_UNCHANGED);
+	vector<uchar>().swap(compressed);
+}
+
+template <typename T>
+void frame<T>::release()
+{
+	image.release();
+	vector<uchar>().swap(compressed);
+	motion_src.release();
+	motion_dst.release();
+}
+
+template <typename T>
 struct state {
 	options opts;
-	deque<frame> queue;
+	task_pool pool;
+	mat_pool* allocator;
+	registration_params reg_params;
+	downscale_cache downscaled;
+	small_lk lk;
+	phase_correlator correlator;
+	registration_cache reg_cache;
+	deque<frame<T>> queue;
+	vector<Transform<T>> replay;
+	// whether the trajectory file has an entry for the input frame
+	vector<bool> replayed;
+	int missing_replay;
 	KalmanFilter delta_filter;
+	// process noise of the delta filter for one frame period
+	Mat process_noise;
+	double prediction_error;
+	int capture_no;
 	int frame_no;
 	Mat canvas;
-	int64 tick_count;
+	Mat yuv_frame;
+	Mat yuv_canvas;
+	Mat bgr_frame;
+	frame_scheduler scheduler;
+	// the window, if shown, runs on another thread
+	gui_pump* gui;
 	int64 last_warning;
+	// input frames to drop and registrations to skip after being late
+	int skip;
+	int degrade;
+	int late_frames;
+	int dropped_frames;
+	int degraded_registrations;
+	quality_controller quality;
+	// registrations left out by the register_every of the quality level
+	int thinned_registrations;
+	// end of the last wait for a deadline
+	int64_t awake;
+	Mat half_canvas;
+	Mat yuv_half_canvas;
+	int64 registration_ticks;
+	int registrations;
+	int static_frames;
+	int skipped_registrations;
+	int vector_registrations;
+	checkpoint_file checkpoint;
+	checkpoint_state snapshot;
+	shm_ring_writer shm;
+	// frames left until the display has caught up after resuming
+	int warmup;
+	Mat key_image;
+	Transform<T> key_sensor;
+	Transform<T> key_velocity;
+	int key_no;
+	int key_interval;
 
 	state(options opts);
 	void run();
 	bool init();
+	bool init_replay();
+	void init_cache();
+	void init_checkpoint();
+	void init_shm(Size size);
+	bool resume();
+	void save_checkpoint();
+	int lookahead() const;
 	void init_filter();
 	bool capture();
 	void advance();
 	bool display();
 	void write_trajectory_header();
 	void compute_transformation();
+	Transform<T> measure(const frame<T>& prev_frame,
+		const frame<T>& next_frame, const Transform<T>& predicted);
+	Transform<T> measure_key(const frame<T>& prev_frame,
+		const frame<T>& next_frame);
+	Mat register_frames(const Mat& prev_image, const Mat& next_image,
+		const Transform<T>& guess, double error);
+	Mat register_vectors(const frame<T>& next_frame);
+	Mat registration_image(const Mat& image) const;
+	static double relative_motion(const Transform<T>& t, Size size);
+	double capture_time() const;
+	T periods(const frame<T>& prev_frame, const frame<T>& next_frame) const;
 	void compute_apparent();
 	void close();
-	int wait();
+	void print_stats();
+	void sweep();
+	bool pace();
+	void adapt(double ms);
 };
 
-state::state(options opts):
+template <typename T>
+state<T>::state(options opts):
 	opts(move(opts)),
-	delta_filter(3,3,0,opencv_traits<t_type>::type),
+	pool(this->opts.threads),
+	// never destroyed, pooled matrices may outlive the state
+	allocator(this->opts.mat_pool ?
+		new mat_pool(this->opts.huge_pages) : 0),
+	correlator(this->opts.phase_rotation),
+	missing_replay(0),
+	delta_filter(3,3,0,opencv_traits<T>::type),
+	prediction_error(1.0),
+	capture_no(0),
 	frame_no(0),
-	tick_count(0),
-	last_warning(0)
+	scheduler(this->opts.fps, this->opts.late),
+	gui(0),
+	last_warning(0),
+	skip(0),
+	degrade(0),
+	late_frames(0),
+	dropped_frames(0),
+	degraded_registrations(0),
+	quality(this->opts.fps),
+	thinned_registrations(0),
+	awake(0),
+	registration_ticks(0),
+	registrations(0),
+	static_frames(0),
+	skipped_registrations(0),
+	vector_registrations(0),
+	warmup(0),
+	key_no(0),
+	key_interval(1)
 {
+	reg_params.ransac_good_ratio = this->opts.ransac_good_ratio;
+	reg_params.ransac_threshold = this->opts.ransac_threshold;
+	reg_params.coarse_to_fine = this->opts.coarse_to_fine;
+	reg_params.pool = &pool;
+	reg_params.cache = &downscaled;
+	if (this->opts.fast_lk)
+		reg_params.lk = &lk;
+	lk.validate = this->opts.validate_lk;
+	if (allocator)
+		allocator->install();
+	if (this->opts.mask) {
+		reg_params.set_mask(*this->opts.mask);
+		correlator.mask = *this->opts.mask;
+	}
 }
 
-void state::compute_transformation()
+template <typename T>
+void state<T>::compute_transformation()
 {
-	frame& prev_frame = queue[1];
-	frame& next_frame = queue[0];
+	frame<T>& prev_frame = queue[1];
+	frame<T>& next_frame = queue[0];
 	if (prev_frame.image.empty() || next_frame.image.empty())
 		return;
-	Mat sensor_delta_mat = estimate_rigid_transform(
-		prev_frame.image, next_frame.image,
-		opts.ransac_good_ratio, opts.ransac_threshold);
-	if (sensor_delta_mat.empty())
-		sensor_delta_mat = Mat::eye(2, 3, opencv_traits<t_type>::type);
-	Transform<t_type> sensor_delta(sensor_delta_mat);
-	Mat sensor_delta_vec = sensor_delta.toVec();
-	delta_filter.predict();
-	Transform<t_type> camera_delta = Transform<t_type>::fromVec(
-		delta_filter.correct(sensor_delta_vec));
-	next_frame.sensor = prev_frame.sensor + sensor_delta;
-	next_frame.camera = prev_frame.camera + camera_delta;
+	// The filter works on the motion per frame period, its uncertainty
+	// grows with the time between the frames.
+	T r = periods(prev_frame, next_frame);
+	// scaled into the existing matrix rather than a new one per frame
+	process_noise.convertTo(delta_filter.processNoiseCov, -1, r);
+	Transform<T> predicted = Transform<T>::fromVec(
+		delta_filter.predict())*r;
+	Transform<T> sensor_delta;
+	if (opts.replay) {
+		int n = next_frame.input_no;
+		int p = prev_frame.input_no;
+		if (p >= 0 && n < static_cast<int>(replay.size()) && replayed[n] &&
+				replayed[p]) {
+			sensor_delta = replay[n].compose(replay[p].inverse());
+		} else if (p >= 0 && missing_replay++ == 0) {
+			cerr << "no motion from frame " << p << " to " << n <<
+				" in the trajectory file, assuming none" << endl;
+		}
+	} else if (opts.register_every > 1) {
+		sensor_delta = measure_key(prev_frame, next_frame);
+	} else {
+		sensor_delta = measure(prev_frame, next_frame, predicted);
+	}
+	typename Transform<T>::vec_type sensor_delta_vec =
+		sensor_delta.toVec()*(1/r);
+	Transform<T> camera_delta = Transform<T>::fromVec(
+		delta_filter.correct(Mat(sensor_delta_vec, false)))*r;
+	next_frame.sensor = sensor_delta.compose(prev_frame.sensor);
+	next_frame.camera = camera_delta.compose(prev_frame.camera);
 	compute_apparent();
 }
 
-void state::compute_apparent()
+template <typename T>
+Transform<T> state<T>::measure(const frame<T>& prev_frame,
+	const frame<T>& next_frame, const Transform<T>& predicted)
+{
+	int frame = next_frame.input_no;
+	// the cache and the motion vectors only hold the motion from the
+	// previous input frame, not across dropped frames
+	bool consecutive = frame == prev_frame.input_no + 1;
+	Mat prev_image = registration_image(prev_frame.image);
+	Mat next_image = registration_image(next_frame.image);
+	Mat sensor_delta_mat;
+	if (!consecutive || !reg_cache.lookup(frame, sensor_delta_mat)) {
+		// only predict the motion of frames left out when late or by
+		// the quality level
+		if (degrade > 0) {
+			--degrade;
+			++degraded_registrations;
+			return predicted;
+		}
+		if (frame % quality.current().register_every != 0) {
+			++thinned_registrations;
+			return predicted;
+		}
+		if (opts.skip_static > 0 &&
+				static_frames < opts.static_refresh &&
+				sample_difference(prev_image, next_image,
+					reg_params) <
+				opts.skip_static) {
+			++static_frames;
+			++skipped_registrations;
+			return Transform<T>();
+		}
+		static_frames = 0;
+		if (consecutive && !next_frame.motion_src.empty())
+			sensor_delta_mat = register_vectors(next_frame);
+		if (sensor_delta_mat.empty())
+			sensor_delta_mat = register_frames(prev_image, next_image,
+				predicted, prediction_error);
+		// results of a degraded quality level are not kept
+		if (consecutive && quality.level == 0)
+			reg_cache.store(frame, sensor_delta_mat);
+	}
+	if (sensor_delta_mat.empty()) {
+		prediction_error = 1.0;
+		return Transform<T>();
+	}
+	// the estimators work in double precision
+	Transform<T> sensor_delta(sensor_delta_mat);
+	prediction_error = relative_motion(sensor_delta - predicted,
+		next_image.size());
+	return sensor_delta;
+}
+
+// Registers the latest frame only against the key frame every few frames
+// and extrapolates the motion of the last key frame interval in between.
+// The sensor path is corrected to the registered key frame, so the error
+// of the extrapolation does not accumulate. Registrations are postponed
+// like in measure() when late or by the quality level.
+template <typename T>
+Transform<T> state<T>::measure_key(const frame<T>& prev_frame,
+	const frame<T>& next_frame)
+{
+	// largest motion relative to the image dimensions registered at once
+	const double MAX_KEY_MOTION = 0.05;
+	// share of the frame period that may be spent on registration
+	const double COST_SHARE = 0.5;
+
+	int n = next_frame.input_no;
+	Mat next_image = registration_image(next_frame.image);
+	if (key_image.empty()) {
+		key_image = registration_image(prev_frame.image);
+		key_sensor = prev_frame.sensor;
+		key_no = prev_frame.input_no;
+	}
+	int span = n - key_no;
+	// input frames dropped when late are extrapolated over as well
+	Transform<T> extrapolated = key_velocity*(n - prev_frame.input_no);
+	if (span < key_interval) {
+		if (degrade > 0)
+			--degrade;
+		return extrapolated;
+	}
+	// a postponed registration is counted on the frame it became due
+	bool became_due = prev_frame.input_no - key_no < key_interval;
+	if (degrade > 0) {
+		--degrade;
+		degraded_registrations += became_due;
+		return extrapolated;
+	}
+	if (span < quality.current().register_every) {
+		thinned_registrations += became_due;
+		return extrapolated;
+	}
+	Size size = next_image.size();
+	Mat m = register_frames(key_image, next_image, key_velocity*span,
+		prediction_error*span);
+	Transform<T> sensor_delta;
+	if (m.empty()) {
+		prediction_error = 1.0;
+		sensor_delta = extrapolated;
+		key_velocity = Transform<T>();
+		key_interval = 1;
+	} else {
+		Transform<T> total(m);
+		prediction_error = relative_motion(total - key_velocity*span,
+			size)/span;
+		sensor_delta = total.compose(key_sensor).compose(
+			prev_frame.sensor.inverse());
+		key_velocity = total/span;
+		double motion = relative_motion(key_velocity, size);
+		int by_motion = motion*opts.register_every > MAX_KEY_MOTION ?
+			MAX_KEY_MOTION/motion : opts.register_every;
+		key_interval = max(1, by_motion);
+		// registering more often than it keeps up with only when
+		// the registration runs over its share of the frame period
+		double ms = registration_ticks*1000/getTickFrequency()/
+			registrations;
+		int by_cost = ceil(ms*opts.fps/1000/COST_SHARE);
+		if (by_cost > 1) {
+			key_interval = max(key_interval,
+				min(by_cost, opts.register_every));
+		}
+	}
+	key_image = next_image;
+	key_sensor = sensor_delta.compose(prev_frame.sensor);
+	key_no = n;
+	return sensor_delta;
+}
+
+// Registers the images starting from the guess, which is expected to be
+// off by the given error relative to the image dimensions. Unreliable
+// guesses, like on the first frames or after a failed registration, are
+// left to the coarse estimate instead.
+template <typename T>
+Mat state<T>::register_frames(const Mat& prev_image, const Mat& next_image,
+	const Transform<T>& guess, double error)
+{
+	// about four pixels at the default resolution
+	const double MAX_GUESS_ERROR = 0.025;
+
+	Mat m;
+	int64 start = getTickCount();
+	switch (opts.estimator) {
+	case lk_estimator:
+		if (error < MAX_GUESS_ERROR || !opts.coarse_to_fine) {
+			m = estimate_rigid_transform(prev_image, next_image,
+				guided_params(reg_params, error), guess.toMat());
+		} else {
+			m = estimate_rigid_transform(prev_image, next_image,
+				reg_params);
+		}
+		break;
+	case phase_estimator:
+		m = correlator.estimate(prev_image, next_image);
+		break;
+	}
+	registration_ticks += getTickCount() - start;
+	++registrations;
+	return m;
+}
+
+// Fits the transformation to the codec motion vectors of the frame with
+// the RANSAC of the estimator, without looking at the images.
+template <typename T>
+Mat state<T>::register_vectors(const frame<T>& next_frame)
+{
+	int64 start = getTickCount();
+	Mat m = estimate_rigid_transform(next_frame.motion_src,
+		next_frame.motion_dst, reg_params);
+	registration_ticks += getTickCount() - start;
+	if (!m.empty()) {
+		++registrations;
+		++vector_registrations;
+	}
+	return m;
+}
+
+// The image registered for a frame, the luma plane of I420 frames.
+template <typename T>
+Mat state<T>::registration_image(const Mat& image) const
+{
+	if (!opts.yuv_input || image.empty())
+		return image;
+	return image.rowRange(0, image.rows*2/3);
+}
+
+// Magnitude of the motion relative to the image dimensions, a turn of the
+// image counting as much as its whole extent.
+template <typename T>
+double state<T>::relative_motion(const Transform<T>& t, Size size)
+{
+	return hypot(t.x, t.y)/max(size.width, size.height) + abs(t.a)/2;
+}
+
+// Capture time of the frame just read, the timestamp of a file or the
+// monotonic time of reading from a device.
+template <typename T>
+double state<T>::capture_time() const
 {
-	frame& prev_frame = queue[1];
-	frame& next_frame = queue[0];
+	if (opts.input_src == device_input)
+		return frame_scheduler::now()/1e6;
+	double ms = opts.capture->get(CV_CAP_PROP_POS_MSEC);
+	if (ms > 0 || opts.fps <= 0)
+		return ms;
+	// without timestamps the frame rate is constant
+	return capture_no*1000/opts.fps;
+}
+
+// Time between the frames in nominal frame periods, 1 if unknown.
+template <typename T>
+T state<T>::periods(const frame<T>& prev_frame, const frame<T>& next_frame)
+	const
+{
+	if (prev_frame.input_no < 0 || next_frame.input_no < 0 || opts.fps <= 0)
+		return 1;
+	T r = (next_frame.timestamp - prev_frame.timestamp)*opts.fps/1000;
+	// timestamps that do not increase, e.g. of a restarted stream
+	return r > 0 ? r : 1;
+}
+
+template <typename T>
+void state<T>::compute_apparent()
+{
+	frame<T>& prev_frame = queue[1];
+	frame<T>& next_frame = queue[0];
 	if (opts.avg_window) {
 		next_frame.apparent = prev_frame.apparent +
 			next_frame.camera / opts.avg_window;
 	} else {
-		next_frame.apparent = prev_frame.apparent + opts.low_pass *
+		T r = periods(prev_frame, next_frame);
+		next_frame.apparent = prev_frame.apparent +
+			low_pass_weight(opts.low_pass, r) *
 			(next_frame.camera - prev_frame.apparent);
 	}
 }
 
-void state::advance()
+template <typename T>
+void state<T>::advance()
 {
 	if (opts.avg_window) {
 		queue.front().apparent -= queue.back().camera / opts.avg_window;
 	}
 	queue.pop_back();
+	// Only the displayed frame, the newer ones and the previous frame for
+	// registration need their images, older frames only their camera
+	// transformation for the moving average.
+	size_t l = lookahead();
+	size_t old = max<size_t>(l, 1) + 1;
+	if (old < queue.size())
+		queue[old].release();
+	// mapped raw frames take no memory of their own
+	if (opts.compress_lookahead && l > 1 && !opts.yuv_input)
+		queue[1].compress();
 }
 
-bool state::capture()
+template <typename T>
+bool state<T>::capture()
 {
+	// frames dropped after being late are only grabbed, not decoded
+	for (; skip > 0 && opts.capture->grab(); --skip) {
+		++capture_no;
+		++dropped_frames;
+	}
+	skip = 0;
 	queue.emplace_front();
+	if (allocator)
+		allocator->use(queue.front().image);
 	bool ok = opts.capture->read(queue.front().image);
-	if (!ok)
+	if (!ok) {
 		queue.pop_front();
-	return ok;
+		return false;
+	}
+	queue.front().timestamp = capture_time();
+	queue.front().input_no = capture_no++;
+#ifdef HAVE_LIBAV
+	if (opts.motion_vectors) {
+		auto mv = static_cast<motion_vector_capture*>(opts.capture.get());
+		frame<T>& f = queue.front();
+		f.motion_src = mv->motion_src;
+		f.motion_dst = mv->motion_dst;
+		if (opts.mask && !f.motion_src.empty())
+			mask_correspondences(*opts.mask, f.motion_src, f.motion_dst);
+	}
+#endif
+	return true;
 }
 
-void state::close()
+template <typename T>
+void state<T>::close()
 {
 	if (opts.avg_window && !opts.output_file.empty()) {
 		for (int i = 0; i < opts.avg_window/2; ++i) {
@@ -143,70 +579,246 @@ void state::close()
 		}
 	}
 	cout << "output frames: " << frame_no << endl;
+	print_stats();
 }
 
-void state::run()
+template <typename T>
+void state<T>::print_stats()
+{
+	if (registrations) {
+		cout << "registration time: " <<
+			registration_ticks*1000/getTickFrequency()/registrations <<
+			" ms/frame" << endl;
+	}
+	if (opts.register_every > 1 && registrations) {
+		cout << "registered every " <<
+			static_cast<double>(capture_no-1)/registrations <<
+			" frames" << endl;
+	}
+	if (skipped_registrations) {
+		cout << "static frames skipped: " << skipped_registrations <<
+			" (" << 100.0*skipped_registrations/
+			(skipped_registrations + registrations) << " %)" << endl;
+	}
+	if (opts.motion_vectors && registrations) {
+		cout << "registered from motion vectors: " <<
+			vector_registrations << " (" <<
+			100.0*vector_registrations/registrations << " %)" << endl;
+	}
+	if (late_frames) {
+		cout << "late frames: " << late_frames << ", " <<
+			dropped_frames << " dropped, " <<
+			degraded_registrations << " registrations skipped" << endl;
+	}
+	if (opts.adaptive) {
+		cout << "quality: " << quality.steps_down << " steps down, " <<
+			quality.steps_up << " up, frames per level";
+		for (int i = 0; i < quality_controller::LEVELS; ++i)
+			cout << ' ' << quality.frames[i];
+		cout << ", " << thinned_registrations << " registrations skipped" <<
+			endl;
+	}
+	if (allocator) {
+		mat_pool_stats s = allocator->stats();
+		cout << "mat pool: " << s.allocations << " allocations, " <<
+			s.reused << " reused, " <<
+			s.reserved_bytes/(1 << 20) << " MiB reserved, " <<
+			s.peak_bytes/(1 << 20) << " MiB peak" << endl;
+		if (s.minor_faults >= 0) {
+			cout << "page faults: " << s.minor_faults << " minor, " <<
+				s.major_faults << " major" << endl;
+		}
+	}
+	if (lk.validate && lk.validation.points > 0) {
+		const lk_validation& v = lk.validation;
+		cout << "lk validation: " << v.points << " points, " <<
+			v.status_mismatches << " status mismatches, " <<
+			(v.compared > 0 ? v.sum_error/v.compared : 0.0) << " mean, " <<
+			v.max_error << " max difference" << endl;
+	}
+	if (missing_replay) {
+		cout << "frames missing from the trajectory: " << missing_replay <<
+			endl;
+	}
+	if (reg_cache.is_open()) {
+		cout << "registration cache: " << reg_cache.hits << " hits, " <<
+			reg_cache.misses << " misses" << endl;
+	}
+}
+
+template <typename T>
+void state<T>::run()
 {
+	if (!init_replay())
+		return;
 	if (!capture())
 		return;
 	if (!init())
 		return;
 	if (!display())
 		return;
+	save_checkpoint();
 	for (;;) {
 		if (!capture())
 			break;
+		if (warmup)
+			--warmup;
 		compute_transformation();
 		advance();
 		if (!display())
 			break;
+		save_checkpoint();
 	}
 	close();
 }
 
-int state::wait()
+template <typename T>
+void state<T>::sweep()
+{
+	if (!init_replay())
+		return;
+	if (!capture())
+		return;
+	init_filter();
+	init_cache();
+	Size size = registration_image(queue.front().image).size();
+	vector<Transform<T>> sensor(1);
+	vector<T> intervals(1, 1);
+	cout << "registering...";
+	cout.flush();
+	while (capture()) {
+		compute_transformation();
+		intervals.push_back(periods(queue[1], queue[0]));
+		queue.pop_back();
+		sensor.push_back(queue.front().sensor);
+	}
+	cout << " done." << endl;
+	print_stats();
+
+	auto values = [](const vector<double>& swept, double value) {
+		return swept.empty() ? vector<double>(1, value) : swept;
+	};
+	vector<double> ps = values(opts.sweep_process_error, opts.process_error);
+	vector<double> ms = values(opts.sweep_measurement_error,
+		opts.measurement_error);
+	vector<double> ls = values(opts.sweep_low_pass, opts.low_pass);
+	vector<int> as = opts.sweep_avg_window;
+	if (as.empty())
+		as.push_back(opts.avg_window);
+	vector<smoothing_params> configs;
+	for (double p: ps)
+		for (double m: ms)
+			for (int a: as)
+				for (double l: ls) {
+					configs.push_back({p, m, l, a});
+					// the low-pass filter is not used with
+					// the moving average
+					if (a)
+						break;
+				}
+	vector<smoothing_score> scores(configs.size());
+	pool.parallel_for(configs.size(), [&](int i) {
+		scores[i] = evaluate_smoothing(sensor, intervals, size,
+			configs[i]);
+	});
+
+	cout <<
+		"process_error" << delim <<
+		"measurement_error" << delim <<
+		"low_pass" << delim <<
+		"avg_window" << delim <<
+		"jitter" << delim <<
+		"max_zoom" << delim <<
+		"border_loss" << endl;
+	for (size_t i = 0; i < configs.size(); ++i) {
+		cout <<
+			configs[i].process_error << delim <<
+			configs[i].measurement_error << delim <<
+			configs[i].low_pass << delim <<
+			configs[i].avg_window << delim <<
+			scores[i].jitter << delim <<
+			scores[i].max_zoom << delim <<
+			scores[i].border_loss << endl;
+	}
+}
+
+// Waits for the deadline of the next frame and takes the keys of the
+// window. Returns false if the user has quit.
+template <typename T>
+bool state<T>::pace()
 {
-	int ms_passed = 0;
-	if (tick_count != 0) {
+	int64_t t = frame_scheduler::now();
+	if (opts.adaptive && awake)
+		adapt((t - awake)/1e6);
+	int missed = scheduler.wait();
+	awake = frame_scheduler::now();
+	if (missed > 0) {
+		late_frames += missed;
 		int64 now = getTickCount();
-		ms_passed = (now - tick_count)*1000 / getTickFrequency();
-		if (ms_passed >= opts.delay) {
-			if ((now-last_warning)/getTickFrequency() > 5) {
-				cerr << "Too slow... (" << ms_passed <<
-					" ms >= " << opts.delay << " ms)" <<
-					endl;
-				last_warning = now;
-			}
-			ms_passed = opts.delay - 1;
+		if ((now-last_warning)/getTickFrequency() > 5) {
+			cerr << "Too slow... (" << missed << " frames late)" << endl;
+			last_warning = now;
 		}
+		switch (opts.late) {
+		case late_skip:
+			skip += missed;
+			break;
+		case late_degrade:
+			degrade += missed;
+			break;
+		case late_catchup:
+			break;
+		}
+	}
+	switch (gui ? gui->take_key() : -1) {
+	case 27:
+	case 'q':
+		return false;
 	}
-	int key = waitKey(opts.delay - ms_passed);
-	tick_count = getTickCount();
-	return key;
+	return true;
 }
 
-bool state::init()
+// Moves the quality level by the time spent on the last frame, not
+// counting the wait for its deadline.
+template <typename T>
+void state<T>::adapt(double ms)
+{
+	if (!quality.update(ms))
+		return;
+	const quality_level& q = quality.current();
+	reg_params.grid_points = q.grid_points;
+	reg_params.ransac_iterations = q.ransac_iterations;
+	cerr << "quality level " << quality.level << ": " << q.name << " (" <<
+		100*quality.load << " % of " << quality.budget_ms << " ms)" <<
+		endl;
+}
+
+template <typename T>
+bool state<T>::init()
 {
-	if (!opts.quiet)
-		namedWindow(program_name, CV_WINDOW_NORMAL);
 	write_trajectory_header();
 	init_filter();
+	init_cache();
+	init_checkpoint();
 	Size canvas_size(opts.display_width, opts.display_height);
+	if (allocator) {
+		allocator->use(canvas);
+		allocator->use(yuv_frame);
+		allocator->use(bgr_frame);
+		allocator->use(yuv_canvas);
+	}
 	canvas.create(canvas_size, CV_8UC3);
-	if (!opts.avg_window)
+	if (opts.yuv_warp)
+		yuv_canvas.create(canvas_size.height*3/2, canvas_size.width, CV_8UC1);
+	init_shm(canvas_size);
+	if (resume() || !opts.avg_window)
 		return true;
 	cout << "buffering...";
 	for (int i = opts.avg_window/2+1; i < opts.avg_window; ++i)
 		queue.emplace_back();
 	for (int i = 0; i < opts.avg_window/2; ++i) {
-		if (!opts.quiet || opts.input_src == device_input) {
-			int key = wait();
-			switch (key) {
-			case 27:
-			case 'q':
-				return false;
-			}
-		}
+		if ((!opts.quiet || opts.input_src == device_input) && !pace())
+			return false;
 		if (!capture())
 			return false;
 		compute_transformation();
@@ -215,12 +827,166 @@ bool state::init()
 	return true;
 }
 
-static constexpr char delim = '\t';
+template <typename T>
+void state<T>::init_checkpoint()
+{
+	if (opts.checkpoint_file.empty())
+		return;
+	if (!checkpoint.open(opts.checkpoint_file, max(opts.avg_window, 1))) {
+		cerr << "unable to open checkpoint file " <<
+			opts.checkpoint_file << ", it must be new, empty or " <<
+			"a checkpoint written with the same --avg-window" << endl;
+	}
+}
+
+template <typename T>
+void state<T>::init_shm(Size size)
+{
+	if (opts.shm_name.empty())
+		return;
+	if (!shm.open(opts.shm_name, size, opts.shm_slots)) {
+		cerr << "unable to create shared memory ring " <<
+			opts.shm_name << endl;
+	}
+}
+
+// Continues the trajectory of the checkpoint with the first captured frame.
+// The frames of the checkpoint have no images, so the first frame is
+// assumed not to move relative to them and the display starts without
+// look-ahead. It catches up by showing each frame twice instead of
+// stalling until the moving average window has been filled.
+template <typename T>
+bool state<T>::resume()
+{
+	if (!opts.resume)
+		return false;
+	size_t window = max(opts.avg_window, 1);
+	if (!checkpoint.load(snapshot) || snapshot.frames.size() != window) {
+		cerr << "no checkpoint to resume from" << endl;
+		return false;
+	}
+	frame_no = snapshot.frame_no;
+	prediction_error = snapshot.prediction_error;
+	Mat(3, 1, CV_64F, snapshot.filter_state).convertTo(
+		delta_filter.statePost, opencv_traits<T>::type);
+	Mat(3, 3, CV_64F, snapshot.filter_cov).convertTo(
+		delta_filter.errorCovPost, opencv_traits<T>::type);
+	for (const array<double, 9>& v: snapshot.frames) {
+		queue.emplace_back();
+		frame<T>& f = queue.back();
+		f.sensor = Transform<T>(v[0], v[1], v[2]);
+		f.camera = Transform<T>(v[3], v[4], v[5]);
+		f.apparent = Transform<T>(v[6], v[7], v[8]);
+	}
+	queue[0].sensor = queue[1].sensor;
+	queue[0].camera = queue[1].camera;
+	compute_apparent();
+	advance();
+	warmup = opts.avg_window/2*2;
+	cout << "resumed at frame " << frame_no << endl;
+	return true;
+}
+
+template <typename T>
+void state<T>::save_checkpoint()
+{
+	if (!checkpoint.is_open())
+		return;
+	snapshot.frame_no = frame_no;
+	snapshot.prediction_error = prediction_error;
+	for (int i = 0; i < 3; ++i)
+		snapshot.filter_state[i] = delta_filter.statePost.at<T>(i);
+	for (int i = 0; i < 9; ++i)
+		snapshot.filter_cov[i] = delta_filter.errorCovPost.at<T>(i/3, i%3);
+	snapshot.frames.resize(queue.size());
+	for (size_t i = 0; i < queue.size(); ++i) {
+		const frame<T>& f = queue[i];
+		snapshot.frames[i] = {{
+			f.sensor.x, f.sensor.y, f.sensor.a,
+			f.camera.x, f.camera.y, f.camera.a,
+			f.apparent.x, f.apparent.y, f.apparent.a
+		}};
+	}
+	checkpoint.save(snapshot);
+}
+
+// Number of frames captured after the displayed one.
+template <typename T>
+int state<T>::lookahead() const
+{
+	if (!opts.avg_window)
+		return 0;
+	return opts.avg_window/2 - (warmup+1)/2;
+}
+
+template <typename T>
+bool state<T>::init_replay()
+{
+	if (!opts.replay)
+		return true;
+	vector<trajectory_entry<T>> entries;
+	if (!read_trajectory(*opts.replay, entries)) {
+		cerr << "invalid trajectory file " << opts.replay_file << endl;
+		return false;
+	}
+	for (const trajectory_entry<T>& e: entries) {
+		if (e.frame < 0)
+			continue;
+		if (e.frame >= static_cast<int>(replay.size())) {
+			replay.resize(e.frame+1);
+			replayed.resize(e.frame+1);
+		}
+		replay[e.frame] = e.sensor;
+		replayed[e.frame] = true;
+	}
+	return true;
+}
+
+template <typename T>
+void state<T>::init_cache()
+{
+	if (opts.registration_cache_dir.empty() || opts.replay)
+		return;
+	if (opts.input_src != file_input) {
+		cerr << "registration cache is only used with input files" << endl;
+		return;
+	}
+	// the registration starts from the prediction of the filter, so its
+	// parameters and precision change the results as well
+	ostringstream params;
+	params <<
+		estimator_str(opts.estimator) << ' ' <<
+		reg_params.ransac_good_ratio << ' ' <<
+		reg_params.ransac_threshold << ' ' <<
+		reg_params.coarse_to_fine << ' ' <<
+		reg_params.grid_points << ' ' <<
+		reg_params.ransac_iterations << ' ' <<
+		opts.phase_rotation << ' ' <<
+		opts.fast_lk << ' ' <<
+		opts.motion_vectors << ' ' <<
+		(opts.mask ? image_hash(*opts.mask) : 0) << ' ' <<
+		opts.process_error << ' ' <<
+		opts.measurement_error << ' ' <<
+		sizeof(T);
+	for (const rect& r: opts.rois)
+		params << ' ' << r.x << ',' << r.y << ',' << r.width << ',' << r.height;
+	int frames = opts.capture->get(CV_CAP_PROP_FRAME_COUNT);
+	if (!reg_cache.open(opts.registration_cache_dir, opts.input_file,
+			params.str(), frames)) {
+		cerr << "unable to open registration cache in " <<
+			opts.registration_cache_dir << endl;
+	}
+}
 
-void state::write_trajectory_header()
+template <typename T>
+void state<T>::write_trajectory_header()
 {
 	if (!opts.trajectory)
 		return;
+	if (opts.binary_trajectory) {
+		write_binary_trajectory_header(*opts.trajectory);
+		return;
+	}
 	*opts.trajectory <<
 		"frame" << delim <<
 		"sensor_x" << delim <<
@@ -234,92 +1000,124 @@ void state::write_trajectory_header()
 		"apparent_a" << endl;
 }
 
-void state::init_filter()
+template <typename T>
+void state<T>::init_filter()
 {
-	Size size = queue.front().image.size();
-	setIdentity(delta_filter.transitionMatrix);
-	setIdentity(delta_filter.measurementMatrix);
-	double perr2 = opts.process_error*opts.process_error;
-	double merr2 = opts.measurement_error*opts.measurement_error;
-	delta_filter.processNoiseCov = (Mat_<t_type>(3,3) <<
-		size.width*size.width*perr2,   0, 0, 0,
-		size.height*size.height*perr2, 0, 0, 0,
-		4*M_PI*M_PI*perr2);
-	delta_filter.measurementNoiseCov = (Mat_<t_type>(3,3) <<
-		size.width*size.width*perr2,   0, 0, 0,
-		size.height*size.height*perr2, 0, 0, 0,
-		4*M_PI*M_PI*perr2);
+	init_delta_filter<T>(delta_filter,
+		registration_image(queue.front().image).size(),
+		opts.process_error, opts.measurement_error);
+	delta_filter.processNoiseCov.copyTo(process_noise);
 }
 
-bool state::display()
+template <typename T>
+bool state<T>::display()
 {
-	const frame& next_frame = queue[0];
-	const frame& disp_frame = opts.avg_window ?
-		queue[opts.avg_window/2] :
-		queue[0];
-	Size in_size = next_frame.image.size();
+	const frame<T>& next_frame = queue[0];
+	queue[lookahead()].decompress();
+	const frame<T>& disp_frame = queue[lookahead()];
 	Size out_size(opts.out_width, opts.out_height);
-	double scale_x = static_cast<double>(out_size.width) / in_size.width;
-	double scale_y = static_cast<double>(out_size.height) / in_size.height;
-	Mat inverse = (next_frame.apparent - disp_frame.camera).toMat();
-	inverse.row(0) *= scale_x;
-	inverse.row(1) *= scale_y;
-	if (opts.zoom > 0.0) {
-		double z = opts.zoom;
-		double w = out_size.width/2;
-		double h = out_size.height/2;
-		inverse(Range(0,2), Range::all()) *= z;
-		inverse.at<t_type>(0,2) += w*(1-z);
-		inverse.at<t_type>(1,2) += h*(1-z);
-	}
-	Mat main_display;
-	Mat secondary_display;
-	if (out_size.width > out_size.height) {
-		main_display = canvas(Range(0,opts.out_height), Range::all());
+	// the frames padded at the end have no image of their own
+	typename Transform<T>::affine_type inverse = warp_matrix(
+		next_frame.apparent.compose(disp_frame.camera.inverse()),
+		registration_image(disp_frame.image).size(), out_size, opts.zoom);
+	// the frame is rendered directly into the shared memory ring
+	if (shm.is_open())
+		canvas = shm.begin();
+	const quality_level& q = quality.current();
+	// warp at half the resolution and scale up when short of time
+	Size warp_size = out_size;
+	typename Transform<T>::affine_type warp = inverse;
+	if (q.half_scale) {
+		warp_size = Size(out_size.width/4*2, out_size.height/4*2);
+		for (int j = 0; j < 3; ++j) {
+			warp(0,j) *= static_cast<T>(warp_size.width)/out_size.width;
+			warp(1,j) *= static_cast<T>(warp_size.height)/out_size.height;
+		}
+	}
+	Rect main_rect(Point(0,0), out_size);
+	Rect secondary_rect;
+	if (out_size.width > out_size.height)
+		secondary_rect = main_rect + Point(0,opts.out_height);
+	else
+		secondary_rect = main_rect + Point(opts.out_width,0);
+
+	if (opts.yuv_warp) {
+		if (opts.yuv_input)
+			yuv_frame = disp_frame.image;
+		else
+			cvtColor(disp_frame.image, yuv_frame, CV_BGR2YUV_I420);
+		yuv420_planes src(yuv_frame);
+		yuv420_planes dst(yuv_canvas);
+		yuv420_planes main_display = dst(main_rect);
+		if (q.half_scale) {
+			yuv_half_canvas.create(warp_size.height*3/2, warp_size.width,
+				CV_8UC1);
+			yuv420_planes half(yuv_half_canvas);
+			warp_affine_yuv420(src, half, warp, q.warp_flags);
+			resize_yuv420(half, main_display);
+		} else {
+			warp_affine_yuv420(src, main_display, warp, q.warp_flags);
+		}
 		if (opts.show_original) {
-			secondary_display = canvas(
-				Range(opts.out_height,opts.out_height*2),
-				Range::all());
+			yuv420_planes secondary_display = dst(secondary_rect);
+			resize_yuv420(src, secondary_display);
 		}
+		// a raw writer takes the YUV canvas as it is
+		if (!opts.quiet || !opts.yuv_output || shm.is_open())
+			cvtColor(yuv_canvas, canvas, CV_YUV2BGR_I420);
 	} else {
-		main_display = canvas(Range::all(), Range(0,opts.out_width));
+		const Mat* image = &disp_frame.image;
+		if (opts.yuv_input) {
+			cvtColor(disp_frame.image, bgr_frame, CV_YUV2BGR_I420);
+			image = &bgr_frame;
+		}
+		Mat main_display = canvas(main_rect);
+		if (q.half_scale) {
+			warpAffine(*image, half_canvas, warp, warp_size, q.warp_flags);
+			resize(half_canvas, main_display, out_size);
+		} else {
+			warpAffine(*image, main_display, warp, out_size, q.warp_flags);
+		}
 		if (opts.show_original) {
-			secondary_display = canvas(
-				Range::all(),
-				Range(opts.out_width,opts.out_width*2));
+			Mat secondary_display = canvas(secondary_rect);
+			resize(*image, secondary_display, out_size);
 		}
 	}
-
-	warpAffine(disp_frame.image, main_display, inverse, out_size);
-	if (opts.show_original) {
-		resize(disp_frame.image, secondary_display, out_size);
+	if (shm.is_open()) {
+		shm_frame f = shm_frame();
+		f.frame_no = frame_no;
+		for (int i = 0; i < 6; ++i)
+			f.warp[i] = inverse.val[i];
+		const Transform<T>* path[] = {
+			&disp_frame.sensor, &disp_frame.camera, &next_frame.apparent
+		};
+		for (int i = 0; i < 3; ++i) {
+			f.trajectory[3*i] = path[i]->x;
+			f.trajectory[3*i+1] = path[i]->y;
+			f.trajectory[3*i+2] = path[i]->a;
+		}
+		shm.commit(f);
 	}
 	if (opts.writer) {
-		opts.writer->write(canvas);
+		opts.writer->write(opts.yuv_warp && opts.yuv_output ?
+			yuv_canvas : canvas);
 	}
-	if (opts.trajectory) {
+	if (opts.trajectory && opts.binary_trajectory) {
+		write_binary_trajectory_entry(*opts.trajectory,
+			disp_frame.input_no, disp_frame.sensor, disp_frame.camera,
+			next_frame.apparent);
+	} else if (opts.trajectory) {
 		*opts.trajectory <<
-			frame_no << delim <<
+			disp_frame.input_no << delim <<
 			with_delim<delim>(disp_frame.sensor) << delim <<
 			with_delim<delim>(disp_frame.camera) << delim <<
 			with_delim<delim>(next_frame.apparent) << '\n';
 	}
 	++frame_no;
-	if (!opts.quiet) {
-		imshow(program_name, canvas);
-	}
-	if (!opts.quiet || opts.input_src == device_input) {
-		int key = wait();
-		switch (key) {
-		case 27:
-		case 'q':
-			return false;
-		case 'r':
-			resizeWindow(program_name, opts.out_width,
-				opts.out_height);
-			break;
-		}
-	}
+	if (gui)
+		gui->show(canvas);
+	if (!opts.quiet || opts.input_src == device_input)
+		return pace();
 	return true;
 }
 
@@ -327,6 +1125,36 @@ bool state::display()
 
 using namespace flutter;
 
+template <typename T>
+static void run(options opts)
+{
+	state<T> st(move(opts));
+	if (st.opts.sweep) {
+		st.sweep();
+		return;
+	}
+	if (st.opts.quiet) {
+		st.run();
+		return;
+	}
+	// HighGUI stays on this thread, the frames are processed on another
+	gui_pump gui(program_name, Size(st.opts.out_width, st.opts.out_height));
+	st.gui = &gui;
+	exception_ptr error;
+	thread worker([&] {
+		try {
+			st.run();
+		} catch (...) {
+			error = current_exception();
+		}
+		gui.finish();
+	});
+	gui.run();
+	worker.join();
+	if (error)
+		rethrow_exception(error);
+}
+
 int main(int argc, char* argv[])
 {
 	options opts;
@@ -339,7 +1167,13 @@ int main(int argc, char* argv[])
 		break;
 	}
 	cout << opts << endl;
-	state st(move(opts));
-	st.run();
+	switch (opts.precision) {
+	case single_precision:
+		run<float>(move(opts));
+		break;
+	case double_precision:
+		run<double>(move(opts));
+		break;
+	}
 	return EXIT_SUCCESS;
 }
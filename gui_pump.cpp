@@ -0,0 +1,62 @@
+#include "gui_pump.h"
+#include <chrono>
+
+flutter::gui_pump::gui_pump(const std::string& window, cv::Size size):
+	window(window),
+	size(size),
+	fresh(false),
+	done(false),
+	key(-1)
+{
+}
+
+void flutter::gui_pump::show(const cv::Mat& frame)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	frame.copyTo(pending);
+	fresh = true;
+	wake.notify_one();
+}
+
+int flutter::gui_pump::take_key()
+{
+	return key.exchange(-1);
+}
+
+void flutter::gui_pump::finish()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	done = true;
+	wake.notify_one();
+}
+
+void flutter::gui_pump::run()
+{
+	// how often events are handled while no frames arrive
+	const int POLL_MS = 10;
+
+	cv::namedWindow(window, CV_WINDOW_NORMAL);
+	for (;;) {
+		bool update = false;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait_for(lock, std::chrono::milliseconds(POLL_MS),
+				[this] { return fresh || done; });
+			if (done)
+				break;
+			if (fresh) {
+				cv::swap(pending, shown);
+				fresh = false;
+				update = true;
+			}
+		}
+		if (update)
+			cv::imshow(window, shown);
+		int k = cv::waitKey(1);
+		if (k == 'r')
+			cv::resizeWindow(window, size.width, size.height);
+		else if (k >= 0)
+			key = k;
+	}
+	cv::destroyWindow(window);
+}
@@ -0,0 +1,42 @@
+#ifndef GUI_PUMP_H
+#define GUI_PUMP_H
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+namespace flutter {
+
+// Runs the HighGUI window on the thread that calls run(), normally the
+// main thread, while the frames are processed on another one. show()
+// only copies the frame to a back buffer, so the processing never waits
+// for the display, and frames the window has not got to are replaced.
+struct gui_pump {
+	std::string window;
+	cv::Size size;
+	std::mutex mutex;
+	std::condition_variable wake;
+	cv::Mat pending;
+	cv::Mat shown;
+	bool fresh;
+	bool done;
+	// latest key pressed, -1 if none
+	std::atomic<int> key;
+
+	gui_pump(const std::string& window, cv::Size size);
+	gui_pump(const gui_pump&) = delete;
+	gui_pump& operator=(const gui_pump&) = delete;
+
+	void show(const cv::Mat& frame);
+	// Returns the latest key pressed and forgets it.
+	int take_key();
+	// Makes run() return.
+	void finish();
+	void run();
+};
+
+}
+
+#endif // GUI_PUMP_H
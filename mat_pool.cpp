@@ -0,0 +1,248 @@
+#include "mat_pool.h"
+#include "config.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#ifdef CAN_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef CAN_GETRUSAGE
+#include <sys/resource.h>
+#endif
+
+// Sits right in front of the data of each buffer.
+struct flutter::mat_pool::block {
+	void* raw;
+	std::size_t size;
+	// length of the mapping, zero if the buffer was allocated with malloc
+	std::size_t length;
+	int size_class;
+	// reference count of OpenCV 2 matrices
+	int refcount;
+};
+
+static const std::size_t MIN_SIZE = 64;
+// buffers at least this large are backed by huge pages if enabled
+static const std::size_t HUGE_PAGE = 2 << 20;
+
+static int size_class(std::size_t n, std::size_t& class_size)
+{
+	if (n <= MIN_SIZE) {
+		class_size = MIN_SIZE;
+		return 0;
+	}
+	std::size_t m = n - 1;
+	int octave = 0;
+	while (m >> (octave + 1))
+		++octave;
+	int sub = (m >> (octave - 2)) & 3;
+	class_size = static_cast<std::size_t>(4 + sub + 1) << (octave - 2);
+	return 1 + (octave - 6)*4 + sub;
+}
+
+static flutter::mat_pool::block* block_of(void* data)
+{
+	return reinterpret_cast<flutter::mat_pool::block*>(data) - 1;
+}
+
+static void free_block(flutter::mat_pool::block* b)
+{
+#ifdef CAN_MMAP
+	if (b->length) {
+		munmap(b->raw, b->length);
+		return;
+	}
+#endif
+	std::free(b->raw);
+}
+
+flutter::mat_pool::mat_pool(bool huge_pages):
+	huge_pages(huge_pages),
+	allocations(0),
+	reused(0),
+	reserved_bytes(0),
+	used_bytes(0),
+	peak_bytes(0)
+{
+}
+
+flutter::mat_pool::~mat_pool()
+{
+	for (std::vector<block*>& list: free_lists) {
+		for (block* b: list)
+			free_block(b);
+	}
+}
+
+void* flutter::mat_pool::acquire(std::size_t size)
+{
+	std::size_t class_size;
+	int c = size_class(size, class_size);
+	CV_Assert(c < CLASSES);
+	++allocations;
+	std::size_t used = used_bytes += class_size;
+	std::size_t peak = peak_bytes;
+	while (used > peak && !peak_bytes.compare_exchange_weak(peak, used))
+		;
+	{
+		std::lock_guard<std::mutex> lock(mutexes[c]);
+		if (!free_lists[c].empty()) {
+			block* b = free_lists[c].back();
+			free_lists[c].pop_back();
+			++reused;
+			return b + 1;
+		}
+	}
+	void* raw = 0;
+	std::size_t length = 0;
+	char* data;
+#ifdef CAN_MMAP
+	if (huge_pages && class_size >= HUGE_PAGE) {
+		length = (class_size + ALIGNMENT + HUGE_PAGE - 1) &
+			~(HUGE_PAGE - 1);
+		raw = mmap(0, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED) {
+			raw = 0;
+			length = 0;
+		}
+#ifdef MADV_HUGEPAGE
+		else {
+			madvise(raw, length, MADV_HUGEPAGE);
+		}
+#endif
+	}
+#endif
+	if (raw) {
+		data = static_cast<char*>(raw) + ALIGNMENT;
+	} else {
+		raw = std::malloc(class_size + 2*ALIGNMENT);
+		if (!raw)
+			CV_Error(CV_StsNoMem, "out of memory");
+		std::uintptr_t p = reinterpret_cast<std::uintptr_t>(raw) +
+			sizeof(block) + ALIGNMENT - 1;
+		data = reinterpret_cast<char*>(p & ~std::uintptr_t(ALIGNMENT - 1));
+	}
+	reserved_bytes += class_size;
+	block* b = block_of(data);
+	b->raw = raw;
+	b->size = class_size;
+	b->length = length;
+	b->size_class = c;
+	b->refcount = 0;
+	return data;
+}
+
+void flutter::mat_pool::recycle(void* data)
+{
+	block* b = block_of(data);
+	used_bytes -= b->size;
+	std::lock_guard<std::mutex> lock(mutexes[b->size_class]);
+	free_lists[b->size_class].push_back(b);
+}
+
+void flutter::mat_pool::install()
+{
+#if CV_MAJOR_VERSION >= 3
+	cv::Mat::setDefaultAllocator(this);
+#endif
+}
+
+void flutter::mat_pool::use(cv::Mat& m)
+{
+#if CV_MAJOR_VERSION < 3
+	m.allocator = this;
+#else
+	(void)m;
+#endif
+}
+
+flutter::mat_pool_stats flutter::mat_pool::stats() const
+{
+	mat_pool_stats s;
+	s.allocations = allocations;
+	s.reused = reused;
+	s.reserved_bytes = reserved_bytes;
+	s.used_bytes = used_bytes;
+	s.peak_bytes = peak_bytes;
+	s.minor_faults = -1;
+	s.major_faults = -1;
+#ifdef CAN_GETRUSAGE
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		s.minor_faults = usage.ru_minflt;
+		s.major_faults = usage.ru_majflt;
+	}
+#endif
+	return s;
+}
+
+#if CV_MAJOR_VERSION < 3
+
+void flutter::mat_pool::allocate(int dims, const int* sizes, int type,
+	int*& refcount, uchar*& datastart, uchar*& data, std::size_t* step)
+{
+	std::size_t total = CV_ELEM_SIZE(type);
+	for (int i = dims-1; i >= 0; --i) {
+		step[i] = total;
+		total *= sizes[i];
+	}
+	uchar* p = static_cast<uchar*>(acquire(total));
+	block* b = block_of(p);
+	b->refcount = 1;
+	refcount = &b->refcount;
+	datastart = data = p;
+}
+
+void flutter::mat_pool::deallocate(int*, uchar* datastart, uchar*)
+{
+	recycle(datastart);
+}
+
+#else
+
+cv::UMatData* flutter::mat_pool::allocate(int dims, const int* sizes,
+	int type, void* data0, std::size_t* step, int,
+	cv::UMatUsageFlags) const
+{
+	std::size_t total = CV_ELEM_SIZE(type);
+	for (int i = dims-1; i >= 0; --i) {
+		if (step) {
+			if (data0 && step[i] != CV_AUTOSTEP) {
+				CV_Assert(total <= step[i]);
+				total = step[i];
+			} else {
+				step[i] = total;
+			}
+		}
+		total *= sizes[i];
+	}
+	uchar* data = data0 ? static_cast<uchar*>(data0) : static_cast<uchar*>(
+		const_cast<mat_pool*>(this)->acquire(total));
+	cv::UMatData* u = new cv::UMatData(this);
+	u->data = u->origdata = data;
+	u->size = total;
+	if (data0)
+		u->flags |= cv::UMatData::USER_ALLOCATED;
+	return u;
+}
+
+bool flutter::mat_pool::allocate(cv::UMatData* u, int,
+	cv::UMatUsageFlags) const
+{
+	return u != 0;
+}
+
+void flutter::mat_pool::deallocate(cv::UMatData* u) const
+{
+	if (!u)
+		return;
+	CV_Assert(u->urefcount == 0 && u->refcount == 0);
+	if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+		const_cast<mat_pool*>(this)->recycle(u->origdata);
+		u->origdata = 0;
+	}
+	delete u;
+}
+
+#endif
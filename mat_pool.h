@@ -0,0 +1,76 @@
+#ifndef MAT_POOL_H
+#define MAT_POOL_H
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+namespace flutter {
+
+struct mat_pool_stats {
+	std::size_t allocations;
+	std::size_t reused;
+	std::size_t reserved_bytes;
+	std::size_t used_bytes;
+	std::size_t peak_bytes;
+	// page faults of the whole process, -1 if unknown
+	long minor_faults;
+	long major_faults;
+};
+
+// A cv::MatAllocator that keeps freed buffers in free lists by size class
+// instead of returning them to the system, so that frames, canvases and
+// registration temporaries of the same size are recycled without page
+// faults. The classes are four per power of two, the buffers are aligned
+// to 64 bytes and large buffers may be backed by huge pages.
+//
+// With OpenCV 3 and later the pool becomes the default allocator of all
+// matrices. OpenCV 2 only supports allocators per matrix, so use() has to
+// be called on the matrices before they are allocated.
+struct mat_pool: public cv::MatAllocator {
+	struct block;
+
+	enum { ALIGNMENT = 64, CLASSES = 240 };
+
+	bool huge_pages;
+	std::mutex mutexes[CLASSES];
+	std::vector<block*> free_lists[CLASSES];
+	std::atomic<std::size_t> allocations;
+	std::atomic<std::size_t> reused;
+	std::atomic<std::size_t> reserved_bytes;
+	std::atomic<std::size_t> used_bytes;
+	std::atomic<std::size_t> peak_bytes;
+
+	explicit mat_pool(bool huge_pages = false);
+	~mat_pool();
+	mat_pool(const mat_pool&) = delete;
+	mat_pool& operator=(const mat_pool&) = delete;
+
+	// Makes the pool the default allocator if supported. The pool must
+	// not be destroyed afterwards, since matrices may outlive any owner.
+	void install();
+	void use(cv::Mat& m);
+	mat_pool_stats stats() const;
+
+	void* acquire(std::size_t size);
+	void recycle(void* data);
+
+#if CV_MAJOR_VERSION < 3
+	void allocate(int dims, const int* sizes, int type, int*& refcount,
+		uchar*& datastart, uchar*& data, std::size_t* step);
+	void deallocate(int* refcount, uchar* datastart, uchar* data);
+#else
+	cv::UMatData* allocate(int dims, const int* sizes, int type,
+		void* data, std::size_t* step, int flags,
+		cv::UMatUsageFlags usage) const;
+	bool allocate(cv::UMatData* data, int access,
+		cv::UMatUsageFlags usage) const;
+	void deallocate(cv::UMatData* data) const;
+#endif
+};
+
+}
+
+#endif // MAT_POOL_H
@@ -0,0 +1,261 @@
+#include "motion_vectors.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/motion_vector.h>
+#include <libswscale/swscale.h>
+}
+
+using namespace cv;
+
+// the codec returned by av_find_best_stream() is const since FFmpeg 5
+#if LIBAVFORMAT_VERSION_MAJOR < 59
+typedef AVCodec* codec_ptr;
+#else
+typedef const AVCodec* codec_ptr;
+#endif
+
+struct flutter::motion_vector_capture::context {
+	AVFormatContext* format;
+	AVCodecContext* codec;
+	AVFrame* frame;
+	AVPacket* packet;
+	SwsContext* scaler;
+	int stream;
+	bool draining;
+	bool b_frames;
+	bool multi_ref;
+	// timestamp of the last frame read
+	double msec;
+
+	context():
+		format(0),
+		codec(0),
+		frame(0),
+		packet(0),
+		scaler(0),
+		stream(-1),
+		draining(false),
+		b_frames(false),
+		multi_ref(false),
+		msec(0.0)
+	{
+	}
+
+	~context()
+	{
+		sws_freeContext(scaler);
+		av_packet_free(&packet);
+		av_frame_free(&frame);
+		avcodec_free_context(&codec);
+		avformat_close_input(&format);
+	}
+
+	bool open(const std::string& file)
+	{
+		if (avformat_open_input(&format, file.c_str(), 0, 0) < 0 ||
+				avformat_find_stream_info(format, 0) < 0)
+			return false;
+		codec_ptr decoder = 0;
+		stream = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1,
+			&decoder, 0);
+		if (stream < 0)
+			return false;
+		codec = avcodec_alloc_context3(decoder);
+		if (!codec || avcodec_parameters_to_context(codec,
+				format->streams[stream]->codecpar) < 0)
+			return false;
+		AVDictionary* opts = 0;
+		av_dict_set(&opts, "flags2", "+export_mvs", 0);
+		int err = avcodec_open2(codec, decoder, &opts);
+		av_dict_free(&opts);
+		if (err < 0)
+			return false;
+		b_frames = codec->has_b_frames > 0;
+		frame = av_frame_alloc();
+		packet = av_packet_alloc();
+		return frame && packet;
+	}
+
+	bool decode()
+	{
+		for (;;) {
+			int err = avcodec_receive_frame(codec, frame);
+			if (err == 0)
+				return true;
+			if (err != AVERROR(EAGAIN) || draining)
+				return false;
+			if (av_read_frame(format, packet) < 0) {
+				avcodec_send_packet(codec, 0);
+				draining = true;
+				continue;
+			}
+			if (packet->stream_index == stream)
+				avcodec_send_packet(codec, packet);
+			av_packet_unref(packet);
+		}
+	}
+
+	// Decodes the next frame with or without the motion vectors. The flag
+	// is read by the decoder for each frame it outputs.
+	bool decode(bool export_mvs)
+	{
+		if (export_mvs)
+			codec->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+		else
+			codec->flags2 &= ~AV_CODEC_FLAG2_EXPORT_MVS;
+		if (!decode())
+			return false;
+		if (frame->pict_type == AV_PICTURE_TYPE_B)
+			b_frames = true;
+		// H.264 and HEVC can predict from any of the stored frames and the
+		// exported vectors do not tell which one
+		if (codec->refs > 1)
+			multi_ref = true;
+		return true;
+	}
+
+	void timestamp()
+	{
+		int64_t pts = frame->best_effort_timestamp;
+		if (pts != AV_NOPTS_VALUE)
+			msec = 1000*pts*av_q2d(format->streams[stream]->time_base);
+	}
+
+	void convert(Mat& image)
+	{
+		scaler = sws_getCachedContext(scaler,
+			frame->width, frame->height,
+			static_cast<AVPixelFormat>(frame->format),
+			frame->width, frame->height, AV_PIX_FMT_BGR24,
+			SWS_POINT, 0, 0, 0);
+		image.create(frame->height, frame->width, CV_8UC3);
+		uint8_t* data[1] = { image.data };
+		int linesize[1] = { static_cast<int>(image.step) };
+		sws_scale(scaler, frame->data, frame->linesize, 0, frame->height,
+			data, linesize);
+	}
+
+	void vectors(Mat& src, Mat& dst)
+	{
+		src.release();
+		dst.release();
+		if (b_frames || multi_ref ||
+				frame->pict_type != AV_PICTURE_TYPE_P)
+			return;
+		AVFrameSideData* side = av_frame_get_side_data(frame,
+			AV_FRAME_DATA_MOTION_VECTORS);
+		if (!side)
+			return;
+		const AVMotionVector* mvs =
+			reinterpret_cast<const AVMotionVector*>(side->data);
+		int n = side->size/sizeof(*mvs);
+		std::vector<Point2f> s, d;
+		s.reserve(n);
+		d.reserve(n);
+		for (int i = 0; i < n; ++i) {
+			// only vectors into a past frame, which with a single
+			// reference frame is the previous one
+			if (mvs[i].source >= 0)
+				continue;
+			s.push_back(Point2f(mvs[i].src_x, mvs[i].src_y));
+			d.push_back(Point2f(mvs[i].dst_x, mvs[i].dst_y));
+		}
+		if (s.empty())
+			return;
+		Mat(s, true).reshape(0, 1).copyTo(src);
+		Mat(d, true).reshape(0, 1).copyTo(dst);
+	}
+};
+
+flutter::motion_vector_capture::motion_vector_capture(const std::string& file):
+	ctx(new context)
+{
+	if (!ctx->open(file))
+		ctx.reset();
+}
+
+flutter::motion_vector_capture::~motion_vector_capture()
+{
+}
+
+bool flutter::motion_vector_capture::isOpened() const
+{
+	return static_cast<bool>(ctx);
+}
+
+#if CV_MAJOR_VERSION < 3
+bool flutter::motion_vector_capture::read(Mat& image)
+#else
+bool flutter::motion_vector_capture::read(OutputArray out)
+#endif
+{
+	if (!ctx || !ctx->decode(true)) {
+		motion_src.release();
+		motion_dst.release();
+		return false;
+	}
+#if CV_MAJOR_VERSION < 3
+	ctx->convert(image);
+#else
+	if (out.kind() == _InputArray::MAT) {
+		ctx->convert(out.getMatRef());
+	} else {
+		Mat image;
+		ctx->convert(image);
+		image.copyTo(out);
+	}
+#endif
+	ctx->vectors(motion_src, motion_dst);
+	ctx->timestamp();
+	av_frame_unref(ctx->frame);
+	return true;
+}
+
+// Skips a frame without converting it or exporting its vectors. The next
+// read has no vectors into the frame it returned before, which the caller
+// sees from the gap in the frame numbers.
+bool flutter::motion_vector_capture::grab()
+{
+	motion_src.release();
+	motion_dst.release();
+	if (!ctx || !ctx->decode(false))
+		return false;
+	ctx->timestamp();
+	av_frame_unref(ctx->frame);
+	return true;
+}
+
+#if CV_MAJOR_VERSION < 3
+double flutter::motion_vector_capture::get(int prop)
+#else
+double flutter::motion_vector_capture::get(int prop) const
+#endif
+{
+	if (!ctx)
+		return 0;
+	const AVStream* s = ctx->format->streams[ctx->stream];
+	switch (prop) {
+	case CV_CAP_PROP_FRAME_WIDTH:
+		return ctx->codec->width;
+	case CV_CAP_PROP_FRAME_HEIGHT:
+		return ctx->codec->height;
+	case CV_CAP_PROP_POS_MSEC:
+		return ctx->msec;
+	case CV_CAP_PROP_FPS:
+		return s->avg_frame_rate.den ? av_q2d(s->avg_frame_rate) : 0;
+	case CV_CAP_PROP_FRAME_COUNT:
+		return s->nb_frames;
+	case CV_CAP_PROP_FOURCC:
+		return s->codecpar->codec_tag;
+	}
+	return 0;
+}
+
+bool flutter::motion_vector_capture::set(int, double)
+{
+	return false;
+}
@@ -0,0 +1,49 @@
+#ifndef MOTION_VECTORS_H
+#define MOTION_VECTORS_H
+
+#include "config.h"
+#include <opencv2/opencv.hpp>
+#include <memory>
+#include <string>
+
+#ifdef HAVE_LIBAV
+
+namespace flutter {
+
+// Reads a video file with libavcodec and exports the motion vectors of
+// the decoder along with the frames. After each read the vectors of the
+// frame are available as point correspondences for registration: the
+// centers of the blocks in the previous frame and the current one.
+//
+// Only predicted frames of streams without B-frames and with a single
+// reference frame are used, since only then are the vectors relative to
+// the previous frame in display order. Intra frames and the other cases
+// leave the correspondences empty and the frames are registered with the
+// estimator instead.
+struct motion_vector_capture: public cv::VideoCapture {
+	struct context;
+	std::unique_ptr<context> ctx;
+	// 1xN CV_32FC2 positions in the previous and in the current frame
+	cv::Mat motion_src;
+	cv::Mat motion_dst;
+
+	explicit motion_vector_capture(const std::string& file);
+	~motion_vector_capture();
+
+	bool isOpened() const;
+	bool grab();
+#if CV_MAJOR_VERSION < 3
+	bool read(cv::Mat& image);
+	double get(int prop);
+#else
+	bool read(cv::OutputArray image);
+	double get(int prop) const;
+#endif
+	bool set(int prop, double value);
+};
+
+}
+
+#endif // HAVE_LIBAV
+
+#endif // MOTION_VECTORS_H
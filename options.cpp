@@ -1,14 +1,18 @@
 #include "options.h"
 #include "opt_parser.h"
 #include "suppress.h"
+#include "motion_vectors.h"
+#include "raw_video.h"
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <locale>
 #include <iterator>
+#include <sstream>
 #include <functional>
 #include <cstdlib>
+#include <cmath>
 
 using namespace std;
 
@@ -44,20 +48,87 @@ static std::string get_codec(int fourcc)
 flutter::options::options():
 	ransac_good_ratio(0.5),
 	ransac_threshold(0.05),
+	coarse_to_fine(false),
+	estimator(lk_estimator),
+	phase_rotation(false),
+	fast_lk(false),
+	validate_lk(false),
+	motion_vectors(false),
+	adaptive(false),
+	threads(0),
+	mat_pool(false),
+	huge_pages(false),
+	precision(double_precision),
+	register_every(1),
+	skip_static(0.0),
+	static_refresh(30),
 	process_error(0.5),
 	measurement_error(0.5),
 	low_pass(0.1),
 	avg_window(0),
+	compress_lookahead(false),
+	sweep(false),
 	fps(30.0),
+	late(late_catchup),
 	zoom(0.0),
+	yuv_warp(false),
 	show_original(false),
 	quiet(false),
 	codec("MJPG"),
 	fourcc(get_fourcc(codec)),
-	input_src(device_input)
+	input_src(device_input),
+	raw_width(0),
+	raw_height(0),
+	yuv_input(false),
+	yuv_output(false),
+	binary_trajectory(false),
+	shm_slots(4),
+	resume(false)
 {
 }
 
+// Comma-separated values, each either a number or a range given as
+// <first>:<last>:<step>.
+static vector<double> parse_values(const string& list)
+{
+	vector<double> values;
+	size_t begin = 0;
+	for (;;) {
+		size_t end = list.find(',', begin);
+		string item = list.substr(begin, end == string::npos ?
+			string::npos : end - begin);
+		vector<double> range;
+		size_t pos = 0;
+		for (;;) {
+			size_t colon = item.find(':', pos);
+			string num = item.substr(pos, colon == string::npos ?
+				string::npos : colon - pos);
+			char* endptr;
+			double v = strtod(num.c_str(), &endptr);
+			if (num.empty() || *endptr)
+				throw opt::parse_error(list);
+			range.push_back(v);
+			if (colon == string::npos)
+				break;
+			pos = colon + 1;
+		}
+		if (range.size() == 1) {
+			values.push_back(range[0]);
+		} else if (range.size() == 3 && range[2] > 0 &&
+				range[0] <= range[1]) {
+			int n = floor((range[1] - range[0])/range[2] + 1e-9) + 1;
+			for (int i = 0; i < n; ++i)
+				values.push_back(range[0] + i*range[2]);
+		} else {
+			throw opt::parse_error(list);
+		}
+		if (end == string::npos)
+			break;
+		begin = end + 1;
+	}
+	return values;
+}
+
 static const flutter::options default_opts;
 
 static void print_help()
@@ -71,6 +142,60 @@ static void print_help()
 		"                                   model. The default is " << default_opts.ransac_good_ratio << ".\n"
 		"  -n, --ransac-threshold=<float>   Maximum inlier distance relative to image\n"
 		"                                   dimensions. The default is " << default_opts.ransac_threshold << ".\n"
+		"      --coarse-to-fine             Estimate the global translation from a very\n"
+		"                                   small image first and refine it with optical\n"
+		"                                   flow, at a higher resolution for large motions.\n"
+		"  -e, --estimator=<name>           Motion estimator, either 'lk' for optical flow\n"
+		"                                   with RANSAC or 'phase' for phase correlation,\n"
+		"                                   which only estimates translation unless\n"
+		"                                   --phase-rotation is given. The default is 'lk'.\n"
+		"      --phase-rotation             Also estimate rotation with phase correlation.\n"
+		"      --fast-lk                    Experimental: track the points of small images\n"
+		"                                   with a vectorized copy of OpenCV's optical\n"
+		"                                   flow for a fixed window size. Check it with\n"
+		"                                   --validate-lk before relying on it.\n"
+		"      --validate-lk                Implies --fast-lk and also tracks the points\n"
+		"                                   with OpenCV's optical flow to report the\n"
+		"                                   differences.\n"
+		"      --motion-vectors             Register the predicted frames of the input\n"
+		"                                   file with the motion vectors of its codec and\n"
+		"                                   only the others with the estimator. Requires\n"
+		"                                   libav and a stream without B-frames and\n"
+		"                                   with a single reference frame.\n"
+		"      --roi=<x>,<y>,<w>,<h>        Register the frames only within the rectangle\n"
+		"                                   given in input pixels. May be repeated.\n"
+		"      --mask=<file>                Register the frames only where the grayscale\n"
+		"                                   image in the file, scaled to the input size,\n"
+		"                                   is nonzero. Combined with --roi if given.\n"
+		"  -j, --threads=<int>              Number of worker threads. The default is the\n"
+		"                                   number of hardware threads.\n"
+		"      --mat-pool                   Recycle image buffers from a pool instead of\n"
+		"                                   allocating them for each frame.\n"
+		"      --huge-pages                 Back large pooled buffers with huge pages.\n"
+		"                                   Implies --mat-pool.\n"
+		"      --precision=<name>           Precision of the camera path and the filters,\n"
+		"                                   either 'float' or 'double'. The default is\n"
+		"                                   'double'.\n"
+		"      --registration-cache=<dir>   Keep the registration results of input files\n"
+		"                                   in the directory and reuse them when the same\n"
+		"                                   file is processed with the same registration\n"
+		"                                   parameters, -p, -m and --precision.\n"
+		"      --register-every=<int>       Register only up to every given number of\n"
+		"                                   frames and extrapolate the motion in between.\n"
+		"                                   Frames are registered more often when the\n"
+		"                                   motion is fast, unless the registration takes\n"
+		"                                   more than half the frame period. Cannot be\n"
+		"                                   combined with --registration-cache and\n"
+		"                                   --skip-static.\n"
+		"      --skip-static=<float>        Skip the registration of frames whose mean\n"
+		"                                   absolute difference to the previous frame is\n"
+		"                                   below the given number of intensity levels\n"
+		"                                   and assume no motion. The frames are compared\n"
+		"                                   as the downscaled gray images registered,\n"
+		"                                   within --mask and --roi. By default every\n"
+		"                                   frame is registered.\n"
+		"      --static-refresh=<int>       Register at least every given number of frames\n"
+		"                                   when skipping static frames. The default is " << default_opts.static_refresh << ".\n"
 		"  -p, --process-noise=<float>      Kalman process noise relative to image"
 		"                                   dimensions. The default is " << default_opts.process_error << "\n"
 		"  -m, --measurement-noise=<float>  Kalman measurement noise relative to image"
@@ -78,6 +203,19 @@ static void print_help()
 		"  -l, --low-pass=<float>           Low pass filter magnitude. The default is " << default_opts.low_pass << ".\n"
 		"  -a, --avg-window=<int>           Centered moving average window size. Overrides\n"
 		"                                   default exponential low-pass filter if set.\n"
+		"      --compress-lookahead         Keep the frames waiting for display with the\n"
+		"                                   moving average compressed losslessly in\n"
+		"                                   memory.\n"
+		"      --sweep=<param>=<values>     Register the input once and report the jitter\n"
+		"                                   and the zoom needed to hide the borders for\n"
+		"                                   every combination of the swept parameters\n"
+		"                                   instead of writing any video. The parameter\n"
+		"                                   is one of p, m, l and a, the values are\n"
+		"                                   separated by commas and may be ranges given\n"
+		"                                   as <first>:<last>:<step>. May be repeated,\n"
+		"                                   parameters not swept keep their value.\n"
+		"                                   Windows must be whole numbers, 0 for the\n"
+		"                                   low-pass filter.\n"
 		"  -d, --device=<int>               Input device number. The default is 0.\n"
 		"                                   If infile is given, it overrides this setting.\n"
 		"  -f, --fps=<float>                Frames per second. Only relevant when output is shown.\n"
@@ -85,6 +223,19 @@ static void print_help()
 		"                                   If the input is a file, the output file will\n"
 		"                                   have the same fps as the input file\n"
 		"                                   regardless of this setting.\n"
+		"      --late=<policy>              What to do when frames take longer than the\n"
+		"                                   frame period to show: 'skip' drops input\n"
+		"                                   frames, 'degrade' skips the registration of\n"
+		"                                   as many frames and 'catchup' shows the frames\n"
+		"                                   without pausing until back on schedule.\n"
+		"                                   The default is 'catchup'.\n"
+		"      --adaptive                   Step down to a smaller registration grid,\n"
+		"                                   fewer RANSAC iterations, registering every\n"
+		"                                   other frame, a nearest neighbour warp and\n"
+		"                                   half the output resolution, in this order,\n"
+		"                                   while the frames take most of the frame\n"
+		"                                   period, and back up when there is headroom.\n"
+		"                                   Only applies to shown or live input.\n"
 		"  -x, --show-original              Show both original and stabilized video on top\n"
 		"                                   of each other.\n"
 		"  -q, --quiet                      Do not display output video.\n"
@@ -95,6 +246,10 @@ static void print_help()
 		"                                   codecs can be found at\n"
 		"                                   http://www.fourcc.org/codecs.php\n"
 		"  -o, --output=<file>              Output file.\n"
+		"      --raw-size=<width>x<height>  Frame size of headerless I420 input.\n"
+		"                                   Files ending with '.y4m' are read and written\n"
+		"                                   as YUV4MPEG2 and files ending with '.yuv' as\n"
+		"                                   raw I420 without a codec.\n"
 		"  -s, --size=<size>                Output frame size. Given as a single scale\n"
 		"                                   number <scale> or as <width>x<height>,\n"
 		"                                   for example, 640x480. Either of the values\n"
@@ -102,7 +257,30 @@ static void print_help()
 		"                                   calculated by preserving the original aspect\n"
 		"                                   ratio. By default the original size is used.\n"
 		"  -z, --zoom=<float>               Scale the video by the given factor.\n"
-		"  -t, --trajectory=<file>          Trajectory data output file.\n"
+		"  -t, --trajectory=<file>          Trajectory data output file. The data is\n"
+		"                                   written in binary if the file name ends\n"
+		"                                   with '.bin' and as tab-separated values\n"
+		"                                   otherwise. The frames are numbered as in\n"
+		"                                   the input, -1 for frames resumed from a\n"
+		"                                   checkpoint.\n"
+		"      --from-trajectory=<file>     Take the sensor motion from a trajectory file\n"
+		"                                   written with -t instead of registering the\n"
+		"                                   frames. The camera path is filtered again\n"
+		"                                   with the current parameters.\n"
+		"      --checkpoint=<file>          Keep the filter state and the recent trajectory\n"
+		"                                   in the file, updated with every frame.\n"
+		"                                   The file must be new, empty or a checkpoint\n"
+		"                                   of the same --avg-window. Other files are\n"
+		"                                   left as they are.\n"
+		"      --resume                     Continue the trajectory from the checkpoint\n"
+		"                                   file without buffering.\n"
+		"      --shm=<name>                 Publish the output frames with their\n"
+		"                                   transformation in a POSIX shared memory ring\n"
+		"                                   for local readers, see flutter-shm-client.\n"
+		"      --shm-slots=<int>            Frames in the ring. The default is " << default_opts.shm_slots << ".\n"
+		"      --yuv-warp                   Warp the frames in YUV 4:2:0 space, the chroma\n"
+		"                                   planes at a quarter of the resolution.\n"
+		"                                   Frame dimensions must be even.\n"
 		;
 }
 
@@ -126,15 +304,114 @@ flutter::parse_status flutter::parse(options& opts, int argc, char* argv[])
 	bool fourcc_set = false;
 	op.add('r', "ransac-ratio", &opts.ransac_good_ratio);
 	op.add('n', "ransac-threshold", &opts.ransac_threshold);
+	op.add('\0', "coarse-to-fine", &opts.coarse_to_fine);
+	op.add('e', "estimator", [&](const std::string& name) {
+		if (name == "lk") {
+			opts.estimator = lk_estimator;
+		} else if (name == "phase") {
+			opts.estimator = phase_estimator;
+		} else {
+			cerr << "unknown estimator " << name << endl;
+			throw fail_exception();
+		}
+	});
+	op.add('\0', "phase-rotation", &opts.phase_rotation);
+	op.add('\0', "fast-lk", &opts.fast_lk);
+	op.add('\0', "validate-lk", [&]() {
+		opts.fast_lk = true;
+		opts.validate_lk = true;
+	});
+	op.add('\0', "motion-vectors", &opts.motion_vectors);
+	op.add('\0', "roi", [&](const std::string& roi) {
+		int v[4];
+		char const* str = roi.c_str();
+		char* endptr;
+		for (int i = 0; i < 4; ++i) {
+			v[i] = strtol(str, &endptr, 10);
+			if (endptr == str || *endptr != (i < 3 ? ',' : '\0'))
+				throw opt::parse_error(roi);
+			str = endptr + 1;
+		}
+		if (v[2] <= 0 || v[3] <= 0)
+			throw opt::parse_error(roi);
+		opts.rois.push_back({v[0], v[1], v[2], v[3]});
+	});
+	op.add('\0', "mask", &opts.mask_file);
+	op.add('j', "threads", &opts.threads);
+	op.add('\0', "mat-pool", &opts.mat_pool);
+	op.add('\0', "huge-pages", [&]() {
+		opts.mat_pool = true;
+		opts.huge_pages = true;
+	});
+	op.add('\0', "precision", [&](const std::string& name) {
+		if (name == "float") {
+			opts.precision = single_precision;
+		} else if (name == "double") {
+			opts.precision = double_precision;
+		} else {
+			cerr << "unknown precision " << name << endl;
+			throw fail_exception();
+		}
+	});
+	op.add('\0', "registration-cache", &opts.registration_cache_dir);
+	op.add('\0', "register-every", &opts.register_every);
+	op.add('\0', "skip-static", &opts.skip_static);
+	op.add('\0', "static-refresh", &opts.static_refresh);
 	op.add('p', "process-noise", &opts.process_error);
 	op.add('m', "measurement-noise", &opts.measurement_error);
 	op.add('l', "low-pass", &opts.low_pass);
 	op.add('a', "avg-window", &opts.avg_window);
+	op.add('\0', "compress-lookahead", &opts.compress_lookahead);
+	op.add('\0', "sweep", [&](const std::string& spec) {
+		size_t eq = spec.find('=');
+		if (eq == string::npos)
+			throw opt::parse_error(spec);
+		string param = spec.substr(0, eq);
+		vector<double> values = parse_values(spec.substr(eq+1));
+		if (param == "p") {
+			opts.sweep_process_error = values;
+		} else if (param == "m") {
+			opts.sweep_measurement_error = values;
+		} else if (param == "l") {
+			opts.sweep_low_pass = values;
+		} else if (param == "a") {
+			for (double v: values) {
+				if (v < 0 || v != floor(v)) {
+					cerr << "invalid moving average window " << v << endl;
+					throw fail_exception();
+				}
+			}
+			opts.sweep_avg_window.assign(values.begin(), values.end());
+		} else {
+			cerr << "unknown sweep parameter " << param << endl;
+			throw fail_exception();
+		}
+		opts.sweep = true;
+	});
 	op.add('f', "fps", &opts.fps);
+	op.add('\0', "adaptive", &opts.adaptive);
+	op.add('\0', "late", [&](const std::string& name) {
+		if (name == "skip") {
+			opts.late = late_skip;
+		} else if (name == "catchup") {
+			opts.late = late_catchup;
+		} else if (name == "degrade") {
+			opts.late = late_degrade;
+		} else {
+			cerr << "unknown late policy " << name << endl;
+			throw fail_exception();
+		}
+	});
 	op.add('x', "show-original", &opts.show_original);
 	op.add('q', "quiet", &opts.quiet);
 	op.add('t', "trajectory", &opts.trajectory_file);
+	op.add('\0', "from-trajectory", &opts.replay_file);
+	op.add('\0', "checkpoint", &opts.checkpoint_file);
+	op.add('\0', "shm", &opts.shm_name);
+	op.add('\0', "shm-slots", &opts.shm_slots);
+	op.add('\0', "resume", &opts.resume);
 	op.add('z', "zoom", &opts.zoom);
+	op.add('\0', "yuv-warp", &opts.yuv_warp);
 	op.add('c', "codec", [&](const std::string& code) {
 		if (code.size() != 4) {
 			cerr << "fourcc should be exactly 4 characters long" <<
@@ -153,6 +430,15 @@ flutter::parse_status flutter::parse(options& opts, int argc, char* argv[])
 		opts.input_src = device_input;
 	});
 	op.add('o', "output", &opts.output_file);
+	op.add('\0', "raw-size", [&](const std::string& size) {
+		char x;
+		std::istringstream in(size);
+		if (!(in >> opts.raw_width >> x >> opts.raw_height) || x != 'x' ||
+				opts.raw_width <= 0 || opts.raw_height <= 0) {
+			cerr << "invalid raw size " << size << endl;
+			throw fail_exception();
+		}
+	});
 	op.add('s', "size", [&](const std::string& size) {
 		scale = 0.0;
 		out_width = 0;
@@ -207,17 +493,61 @@ flutter::parse_status flutter::parse(options& opts, int argc, char* argv[])
 	} catch (const fail_exception& err) {
 		return fail;
 	}
+	if (opts.shm_slots < 2) {
+		cerr << "the shared memory ring needs at least 2 slots" << endl;
+		return fail;
+	}
+	if (opts.register_every > 1 && (!opts.registration_cache_dir.empty() ||
+			opts.skip_static > 0)) {
+		cerr << "--register-every cannot be combined with " <<
+			"--registration-cache or --skip-static" << endl;
+		return fail;
+	}
+	if (opts.resume && opts.checkpoint_file.empty()) {
+		cerr << "--resume requires --checkpoint" << endl;
+		return fail;
+	}
 	if (op.pos_args.size() > 1) {
 		cerr << "at most one infile expected" << endl;
 		return fail;
 	} else if (op.pos_args.size() == 1) {
 		opts.input_file = op.pos_args.front();
-		if (!get_video_capture(opts.capture, opts.input_file)) {
+		raw_video_format format;
+		bool opened;
+		if (raw_video_format_of(opts.input_file, format)) {
+			opts.capture = make_unique<raw_video_capture>(opts.input_file,
+				format, cv::Size(opts.raw_width, opts.raw_height),
+				opts.fps);
+			opened = opts.yuv_input = opts.capture->isOpened();
+		} else {
+			opened = get_video_capture(opts.capture, opts.input_file);
+		}
+		if (!opened) {
 			cerr << "unable to open file " << opts.input_file << endl;
 			return fail;
 		}
 		opts.input_src = file_input;
 	}
+	if (opts.motion_vectors) {
+		if (opts.input_src != file_input) {
+			cerr << "--motion-vectors requires an input file" << endl;
+			return fail;
+		}
+#ifdef HAVE_LIBAV
+		unique_ptr<cv::VideoCapture> mv =
+			make_unique<motion_vector_capture>(opts.input_file);
+		if (!mv->isOpened()) {
+			cerr << "unable to decode file " << opts.input_file <<
+				" with libav" << endl;
+			return fail;
+		}
+		opts.capture.swap(mv);
+		opts.yuv_input = false;
+#else
+		cerr << "--motion-vectors is not supported without libav" << endl;
+		return fail;
+#endif
+	}
 	if (!opts.capture && !get_video_capture(opts.capture)) {
 		cerr << "unable to open default device" << endl;
 		return fail;
@@ -240,6 +570,38 @@ flutter::parse_status flutter::parse(options& opts, int argc, char* argv[])
 		opts.out_width = in_width;
 		opts.out_height = in_height;
 	}
+	if (!opts.rois.empty() || !opts.mask_file.empty()) {
+		cv::Size size(in_width, in_height);
+		cv::Mat mask(size, CV_8UC1, cv::Scalar::all(255));
+		if (!opts.mask_file.empty()) {
+			cv::Mat file = cv::imread(opts.mask_file, CV_LOAD_IMAGE_GRAYSCALE);
+			if (file.empty()) {
+				cerr << "unable to open file " << opts.mask_file << endl;
+				return fail;
+			}
+			cv::resize(file, file, size, 0, 0, cv::INTER_NEAREST);
+			cv::threshold(file, mask, 0, 255, cv::THRESH_BINARY);
+		}
+		if (!opts.rois.empty()) {
+			cv::Mat roi_mask(size, CV_8UC1, cv::Scalar::all(0));
+			for (const rect& r: opts.rois) {
+				cv::Rect roi = cv::Rect(r.x, r.y, r.width, r.height) &
+					cv::Rect(cv::Point(0, 0), size);
+				roi_mask(roi).setTo(cv::Scalar::all(255));
+			}
+			mask &= roi_mask;
+		}
+		if (!cv::countNonZero(mask)) {
+			cerr << "registration mask is empty" << endl;
+			return fail;
+		}
+		opts.mask = make_unique<cv::Mat>(mask);
+	}
+	if (opts.yuv_warp && (in_width % 2 || in_height % 2 ||
+			opts.out_width % 2 || opts.out_height % 2)) {
+		cerr << "YUV warp requires even frame dimensions" << endl;
+		return fail;
+	}
 	opts.display_width = opts.out_width;
 	opts.display_height = opts.out_height;
 	if (opts.show_original) {
@@ -261,21 +623,38 @@ flutter::parse_status flutter::parse(options& opts, int argc, char* argv[])
 	if (!opts.output_file.empty()) {
 
 		cv::Size size(opts.display_width, opts.display_height);
-		opts.writer = make_unique<cv::VideoWriter>(opts.output_file,
-			opts.fourcc, opts.fps, size);
+		raw_video_format format;
+		opts.yuv_output = raw_video_format_of(opts.output_file, format);
+		if (opts.yuv_output)
+			opts.writer = make_unique<raw_video_writer>(opts.output_file,
+				format, opts.fps, size);
+		else
+			opts.writer = make_unique<cv::VideoWriter>(opts.output_file,
+				opts.fourcc, opts.fps, size);
 		if (!opts.writer->isOpened()) {
 			cerr << "unable to open file " << opts.output_file << endl;
 			return fail;
 		}
 	}
 	if (!opts.trajectory_file.empty()) {
-		opts.trajectory = make_unique<ofstream>(opts.trajectory_file);
+		const string ext = ".bin";
+		const string& file = opts.trajectory_file;
+		opts.binary_trajectory = file.size() > ext.size() &&
+			file.compare(file.size()-ext.size(), ext.size(), ext) == 0;
+		opts.trajectory = make_unique<ofstream>(opts.trajectory_file,
+			opts.binary_trajectory ? ios::binary : ios::out);
 		if (opts.trajectory->fail()) {
 			cerr << "unable to open file " << opts.trajectory_file << endl;
 			return fail;
 		}
 	}
-	opts.delay = 1000/opts.fps;
+	if (!opts.replay_file.empty()) {
+		opts.replay = make_unique<ifstream>(opts.replay_file, ios::binary);
+		if (opts.replay->fail()) {
+			cerr << "unable to open file " << opts.replay_file << endl;
+			return fail;
+		}
+	}
 	return cont;
 }
 
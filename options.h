@@ -3,10 +3,12 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <iosfwd>
 
 namespace cv
 {
+class Mat;
 class VideoCapture;
 class VideoWriter;
 }
@@ -19,31 +21,101 @@ enum input_source {
         file_input
 };
 
+enum estimator_type {
+        lk_estimator,
+        phase_estimator
+};
+
+// What to do when the shown frames are late.
+enum late_policy {
+        // drop input frames to get back to real time
+        late_skip,
+        // keep the deadlines and run without pausing until caught up
+        late_catchup,
+        // skip the registration of as many frames as were late
+        late_degrade
+};
+
+enum precision_type {
+        single_precision,
+        double_precision
+};
+
+struct rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
 struct options {
 	double ransac_good_ratio;
 	double ransac_threshold;
+	bool coarse_to_fine;
+	estimator_type estimator;
+	bool phase_rotation;
+	// track with small_lk instead of calcOpticalFlowPyrLK
+	bool fast_lk;
+	bool validate_lk;
+	bool motion_vectors;
+	// step down to cheaper settings when the frames are late
+	bool adaptive;
+	std::vector<rect> rois;
+	std::string mask_file;
+	int threads;
+	bool mat_pool;
+	bool huge_pages;
+	precision_type precision;
+	std::string registration_cache_dir;
+	int register_every;
+	double skip_static;
+	int static_refresh;
 	double process_error;
 	double measurement_error;
 	double low_pass;
 	int avg_window;
+	bool compress_lookahead;
+	bool sweep;
+	std::vector<double> sweep_process_error;
+	std::vector<double> sweep_measurement_error;
+	std::vector<double> sweep_low_pass;
+	std::vector<int> sweep_avg_window;
 	double fps;
-	int delay;
+	late_policy late;
 	bool quiet;
 	std::string codec;
 	int fourcc;
 	input_source input_src;
 	std::string input_file;
 	std::string output_file;
+	// size of headerless raw input
+	int raw_width;
+	int raw_height;
+	// the frames are I420 images from a raw video file
+	bool yuv_input;
+	// the writer takes I420 images
+	bool yuv_output;
 	std::string trajectory_file;
+	bool binary_trajectory;
+	std::string replay_file;
+	std::string checkpoint_file;
+	std::string shm_name;
+	int shm_slots;
+	bool resume;
 	int out_width;
 	int out_height;
 	int display_width;
 	int display_height;
 	bool show_original;
 	double zoom;
+	bool yuv_warp;
+	// registration mask combined from the regions of interest and the
+	// mask file at the input size, empty if neither is given
+	std::unique_ptr<cv::Mat> mask;
 	std::unique_ptr<cv::VideoCapture> capture;
 	std::unique_ptr<cv::VideoWriter> writer;
 	std::unique_ptr<std::ofstream> trajectory;
+	std::unique_ptr<std::ifstream> replay;
 
 	options();
 };
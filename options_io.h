@@ -23,6 +23,41 @@ inline char const* input_str(input_source src)
 	return "";
 }
 
+inline char const* estimator_str(estimator_type e)
+{
+	switch (e) {
+	case lk_estimator:
+		return "lk_estimator";
+	case phase_estimator:
+		return "phase_estimator";
+	}
+	return "";
+}
+
+inline char const* late_str(late_policy l)
+{
+	switch (l) {
+	case late_skip:
+		return "late_skip";
+	case late_catchup:
+		return "late_catchup";
+	case late_degrade:
+		return "late_degrade";
+	}
+	return "";
+}
+
+inline char const* precision_str(precision_type p)
+{
+	switch (p) {
+	case single_precision:
+		return "single_precision";
+	case double_precision:
+		return "double_precision";
+	}
+	return "";
+}
+
 inline std::ostream& operator<<(std::ostream& o, options const& opts)
 {
 	using namespace std;
@@ -30,20 +65,50 @@ inline std::ostream& operator<<(std::ostream& o, options const& opts)
 		"{" << endl <<
 		"  ransac_good_ratio: " << opts.ransac_good_ratio << "," << endl <<
 		"  ransac_threshold: " << opts.ransac_threshold<< "," << endl <<
+		"  coarse_to_fine: " << bool_str(opts.coarse_to_fine) << "," << endl <<
+		"  estimator: " << estimator_str(opts.estimator) << "," << endl <<
+		"  phase_rotation: " << bool_str(opts.phase_rotation) << "," << endl <<
+		"  fast_lk: " << bool_str(opts.fast_lk) << "," << endl <<
+		"  validate_lk: " << bool_str(opts.validate_lk) << "," << endl <<
+		"  motion_vectors: " << bool_str(opts.motion_vectors) << "," << endl <<
+		"  rois: " << opts.rois.size() << "," << endl <<
+		"  mask_file: \"" << opts.mask_file << "\"," << endl <<
+		"  threads: " << opts.threads << "," << endl <<
+		"  mat_pool: " << bool_str(opts.mat_pool) << "," << endl <<
+		"  huge_pages: " << bool_str(opts.huge_pages) << "," << endl <<
+		"  precision: " << precision_str(opts.precision) << "," << endl <<
+		"  registration_cache_dir: \"" << opts.registration_cache_dir << "\"," << endl <<
+		"  register_every: " << opts.register_every << "," << endl <<
+		"  skip_static: " << opts.skip_static << "," << endl <<
+		"  static_refresh: " << opts.static_refresh << "," << endl <<
 		"  process_error: " << opts.process_error << "," << endl <<
 		"  measurement_error: " << opts.measurement_error << "," << endl <<
 		"  low_pass: " << opts.low_pass << "," << endl <<
 		"  avg_window: " << opts.avg_window << "," << endl <<
+		"  compress_lookahead: " << bool_str(opts.compress_lookahead) << "," << endl <<
+		"  sweep: " << bool_str(opts.sweep) << "," << endl <<
 		"  fps: " << opts.fps << "," << endl <<
-		"  delay: " << opts.delay << "," << endl <<
+		"  late: " << late_str(opts.late) << "," << endl <<
+		"  adaptive: " << bool_str(opts.adaptive) << "," << endl <<
 		"  quiet: " << bool_str(opts.quiet) << "," << endl <<
 		"  codec: " << opts.codec << "," << endl <<
 		"  fourcc: 0x" << hex << opts.fourcc << dec << "," << endl <<
 		"  input_src: " << input_str(opts.input_src) << "," << endl <<
 		"  input_file: \"" << opts.input_file << "\"," << endl <<
 		"  output_file: \"" << opts.output_file << "\"," << endl <<
+		"  raw_width: " << opts.raw_width << "," << endl <<
+		"  raw_height: " << opts.raw_height << "," << endl <<
+		"  yuv_input: " << bool_str(opts.yuv_input) << "," << endl <<
+		"  yuv_output: " << bool_str(opts.yuv_output) << "," << endl <<
 		"  trajectory_file: \"" << opts.trajectory_file << "\"," << endl <<
+		"  binary_trajectory: " << bool_str(opts.binary_trajectory) << "," << endl <<
+		"  replay_file: \"" << opts.replay_file << "\"," << endl <<
+		"  checkpoint_file: \"" << opts.checkpoint_file << "\"," << endl <<
+		"  resume: " << bool_str(opts.resume) << "," << endl <<
+		"  shm_name: \"" << opts.shm_name << "\"," << endl <<
+		"  shm_slots: " << opts.shm_slots << "," << endl <<
 		"  zoom: \"" << opts.zoom << "\"," << endl <<
+		"  yuv_warp: " << bool_str(opts.yuv_warp) << "," << endl <<
 		"  out_width: " << opts.out_width << "," << endl <<
 		"  out_height: " << opts.out_height << "," << endl <<
 		"}";
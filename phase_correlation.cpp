@@ -0,0 +1,204 @@
+#include "phase_correlation.h"
+#include "downscale.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace cv;
+
+void flutter::spectrum(InputArray src, InputArray window, Mat& dst)
+{
+	Mat img;
+	src.getMat().convertTo(img, CV_64F);
+	Mat w = window.getMat();
+	if (!w.empty())
+		multiply(img, w, img, 1, CV_64F);
+	dft(img, dst, DFT_COMPLEX_OUTPUT);
+}
+
+Point2d flutter::correlate_spectra(const Mat& a, const Mat& b, double* response)
+{
+	CV_Assert(a.size() == b.size() && a.type() == CV_64FC2 &&
+		b.type() == CV_64FC2);
+	Mat c, r;
+	mulSpectrums(b, a, c, 0, true);
+	// keep only the phase of the cross-power spectrum
+	for (int i = 0; i < c.rows; ++i) {
+		Vec2d* p = c.ptr<Vec2d>(i);
+		for (int j = 0; j < c.cols; ++j) {
+			double mag = std::sqrt(p[j][0]*p[j][0] + p[j][1]*p[j][1]);
+			if (mag > DBL_EPSILON)
+				p[j] *= 1/mag;
+			else
+				p[j] = Vec2d(0, 0);
+		}
+	}
+	idft(c, r, DFT_REAL_OUTPUT | DFT_SCALE);
+
+	Point peak;
+	minMaxLoc(r, 0, 0, 0, &peak);
+	// weighted centroid of the neighbourhood for sub-pixel accuracy,
+	// the correlation surface wraps around
+	double sum = 0, sx = 0, sy = 0;
+	for (int dy = -1; dy <= 1; ++dy) {
+		int y = (peak.y + dy + r.rows) % r.rows;
+		for (int dx = -1; dx <= 1; ++dx) {
+			int x = (peak.x + dx + r.cols) % r.cols;
+			double v = std::max(r.at<double>(y, x), 0.0);
+			sum += v;
+			sx += v*dx;
+			sy += v*dy;
+		}
+	}
+	Point2d d(peak.x, peak.y);
+	if (sum > 0) {
+		d.x += sx/sum;
+		d.y += sy/sum;
+	}
+	if (d.x > r.cols/2)
+		d.x -= r.cols;
+	if (d.y > r.rows/2)
+		d.y -= r.rows;
+	if (response)
+		*response = std::min(sum, 1.0);
+	return d;
+}
+
+Point2d flutter::phase_correlate(InputArray src1, InputArray src2,
+	InputArray window, double* response)
+{
+	Mat a, b;
+	spectrum(src1, window, a);
+	spectrum(src2, window, b);
+	return correlate_spectra(a, b, response);
+}
+
+void flutter::mask_window(Mat& window, const Mat& mask)
+{
+	Mat m;
+	resize(mask, m, window.size(), 0, 0, INTER_AREA);
+	m.convertTo(m, CV_64F, 1/255.);
+	multiply(window, m, window);
+}
+
+flutter::phase_correlator::phase_correlator(bool rotation):
+	rotation(rotation),
+	scale(1)
+{
+}
+
+void flutter::phase_correlator::prepare(const Mat& src, Mat& gray)
+{
+	const int WIDTH = 160, HEIGHT = 120;
+
+	scale = MAX((double)WIDTH/src.cols, (double)HEIGHT/src.rows);
+	scale = MIN(scale, 1.);
+	Size size(cvRound(src.cols * scale), cvRound(src.rows * scale));
+	if (window.size() != size) {
+		createHanningWindow(window, size, CV_64F);
+		if (!mask.empty())
+			mask_window(window, mask);
+		map_x.release();
+		map_y.release();
+	}
+	if (src.depth() == CV_8U) {
+		downscale_gray(src, gray, size);
+		return;
+	}
+	resize(src, gray, size, 0, 0, INTER_AREA);
+	if (gray.channels() != 1)
+		cvtColor(gray, gray, CV_BGR2GRAY);
+}
+
+void flutter::phase_correlator::polar_spectrum(const Mat& spectrum, Mat& polar)
+{
+	const int ANGLES = 180, RADII = 64;
+	// normalized frequencies of the sampled band
+	const double MAX_RHO = 0.45;
+
+	if (map_x.empty()) {
+		int w = spectrum.cols, h = spectrum.rows;
+		double min_rho = 2.0/MIN(w, h);
+		double log_step = std::log(MAX_RHO/min_rho)/(RADII-1);
+		map_x.create(ANGLES, RADII, CV_32F);
+		map_y.create(ANGLES, RADII, CV_32F);
+		for (int i = 0; i < ANGLES; ++i) {
+			double phi = i*CV_PI/ANGLES;
+			for (int j = 0; j < RADII; ++j) {
+				double rho = min_rho*std::exp(j*log_step);
+				// negative frequencies wrap around
+				map_x.at<float>(i, j) = rho*std::cos(phi)*w;
+				map_y.at<float>(i, j) = rho*std::sin(phi)*h;
+			}
+		}
+	}
+	Mat planes[2], mag, samples;
+	split(spectrum, planes);
+	magnitude(planes[0], planes[1], mag);
+	mag += Scalar::all(1);
+	log(mag, mag);
+	remap(mag, samples, map_x, map_y, INTER_LINEAR, BORDER_WRAP);
+	flutter::spectrum(samples, noArray(), polar);
+}
+
+void flutter::phase_correlator::transform(const Mat& gray, Mat& spec, Mat& polar)
+{
+	spectrum(gray, window, spec);
+	if (rotation)
+		polar_spectrum(spec, polar);
+}
+
+Mat flutter::phase_correlator::estimate(const Mat& src1, const Mat& src2)
+{
+	const double MIN_RESPONSE = 0.05;
+
+	Mat gray1, gray2, spec1, spec2, polar1, polar2;
+	if (src1.data == cached_image.data && src1.size() == cached_image.size()) {
+		spec1 = cached_spectrum;
+		polar1 = cached_polar;
+	} else {
+		prepare(src1, gray1);
+		transform(gray1, spec1, polar1);
+	}
+	prepare(src2, gray2);
+	transform(gray2, spec2, polar2);
+	cached_image = src2;
+	cached_spectrum = spec2;
+	cached_polar = polar2;
+
+	Mat_<double> M = Mat_<double>::eye(2, 3);
+	double response;
+	if (rotation) {
+		// the magnitude spectrum rotates with the image and is
+		// translation invariant
+		Point2d r = correlate_spectra(polar1, polar2, &response);
+		if (response < MIN_RESPONSE)
+			return Mat();
+		double a = r.y*CV_PI/polar1.rows;
+		double ca = std::cos(a), sa = std::sin(a);
+		Point2d c((gray2.cols-1)/2.0, (gray2.rows-1)/2.0);
+		Mat derotated, spec;
+		warpAffine(gray2, derotated,
+			getRotationMatrix2D(c, a*180/CV_PI, 1.0), gray2.size(),
+			INTER_LINEAR, BORDER_REFLECT);
+		spectrum(derotated, window, spec);
+		Point2d d = correlate_spectra(spec1, spec, &response);
+		// p2 = R(p1 - c) + c + R d
+		M(0,0) = ca;
+		M(0,1) = -sa;
+		M(1,0) = sa;
+		M(1,1) = ca;
+		M(0,2) = c.x - (ca*c.x - sa*c.y) + (ca*d.x - sa*d.y);
+		M(1,2) = c.y - (sa*c.x + ca*c.y) + (sa*d.x + ca*d.y);
+	} else {
+		Point2d d = correlate_spectra(spec1, spec2, &response);
+		M(0,2) = d.x;
+		M(1,2) = d.y;
+	}
+	if (response < MIN_RESPONSE)
+		return Mat();
+	M(0,2) /= scale;
+	M(1,2) /= scale;
+	return M;
+}
@@ -0,0 +1,50 @@
+#ifndef PHASE_CORRELATION_H
+#define PHASE_CORRELATION_H
+
+#include <opencv2/opencv.hpp>
+
+namespace flutter {
+
+// Windowed complex spectrum of a single channel floating point image.
+void spectrum(cv::InputArray src, cv::InputArray window, cv::Mat& dst);
+
+// Translation of the image of spectrum b relative to the image of
+// spectrum a, i.e. a point p in a is at p + d in b. The response is the
+// normalized peak value between 0 and 1.
+cv::Point2d correlate_spectra(const cv::Mat& a, const cv::Mat& b,
+	double* response = 0);
+
+cv::Point2d phase_correlate(cv::InputArray src1, cv::InputArray src2,
+	cv::InputArray window, double* response = 0);
+
+// Weights the window by a mask at any resolution, so that only the parts
+// of the images where the mask is nonzero contribute to the correlation.
+void mask_window(cv::Mat& window, const cv::Mat& mask);
+
+// Translation and optionally rotation between consecutive frames by phase
+// correlation of downscaled grayscale images. The spectra of the latest
+// frame are kept so that each frame is transformed only once.
+struct phase_correlator {
+	bool rotation;
+	double scale;
+	// optional 8-bit mask of the regions to correlate
+	cv::Mat mask;
+	cv::Mat window;
+	cv::Mat map_x;
+	cv::Mat map_y;
+	cv::Mat cached_image;
+	cv::Mat cached_spectrum;
+	cv::Mat cached_polar;
+
+	explicit phase_correlator(bool rotation = false);
+	// Returns the 2x3 transformation from src1 to src2, or an empty
+	// matrix if the correlation is too weak.
+	cv::Mat estimate(const cv::Mat& src1, const cv::Mat& src2);
+	void prepare(const cv::Mat& src, cv::Mat& gray);
+	void transform(const cv::Mat& src, cv::Mat& spectrum, cv::Mat& polar);
+	void polar_spectrum(const cv::Mat& spectrum, cv::Mat& polar);
+};
+
+}
+
+#endif // PHASE_CORRELATION_H
@@ -0,0 +1,52 @@
+#include "quality.h"
+#include <opencv2/opencv.hpp>
+
+const flutter::quality_level
+flutter::quality_controller::levels[quality_controller::LEVELS] = {
+	{ "full quality", 15, 500, 1, cv::INTER_LINEAR, false },
+	{ "smaller registration grid", 10, 500, 1, cv::INTER_LINEAR, false },
+	{ "fewer RANSAC iterations", 10, 100, 1, cv::INTER_LINEAR, false },
+	{ "registration every other frame", 10, 100, 2, cv::INTER_LINEAR,
+		false },
+	{ "nearest neighbour warp", 10, 100, 2, cv::INTER_NEAREST, false },
+	{ "half output scale", 10, 100, 2, cv::INTER_NEAREST, true }
+};
+
+flutter::quality_controller::quality_controller(double fps):
+	budget_ms(fps > 0 ? 1000/fps : 0),
+	load(0),
+	level(0),
+	held(0),
+	steps_down(0),
+	steps_up(0),
+	frames()
+{
+}
+
+bool flutter::quality_controller::update(double ms)
+{
+	// weight of a frame in the average load
+	const double SMOOTHING = 0.1;
+	// shares of the budget above which to step down and below which to
+	// step up
+	const double HIGH_LOAD = 0.9, LOW_LOAD = 0.5;
+	// frames to wait after a change before stepping down and up again
+	const int HOLD_DOWN = 10, HOLD_UP = 90;
+
+	++frames[level];
+	if (budget_ms <= 0)
+		return false;
+	load += SMOOTHING*(ms/budget_ms - load);
+	++held;
+	if (load > HIGH_LOAD && held >= HOLD_DOWN && level+1 < LEVELS) {
+		++level;
+		++steps_down;
+	} else if (load < LOW_LOAD && held >= HOLD_UP && level > 0) {
+		--level;
+		++steps_up;
+	} else {
+		return false;
+	}
+	held = 0;
+	return true;
+}
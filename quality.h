@@ -0,0 +1,53 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+namespace flutter {
+
+// Settings of a step on the ladder of cheaper processing. Each step keeps
+// the savings of the previous ones.
+struct quality_level {
+	const char* name;
+	// rows of the registration point grid
+	int grid_points;
+	int ransac_iterations;
+	// register only every n:th frame and predict the others
+	int register_every;
+	// interpolation of the warp
+	int warp_flags;
+	// warp at half the output resolution and scale up
+	bool half_scale;
+};
+
+// Moves along the ladder by the time spent on each frame compared to the
+// frame period: down while the frames use up most of their budget and
+// back up after having had headroom for a while. The gap between the
+// thresholds and the longer wait for stepping up keep the level from
+// oscillating under bursty load.
+struct quality_controller {
+	enum { LEVELS = 6 };
+	static const quality_level levels[LEVELS];
+
+	double budget_ms;
+	// average share of the budget used per frame
+	double load;
+	int level;
+	// frames processed since the level changed
+	int held;
+	int steps_down;
+	int steps_up;
+	// frames processed at each level
+	int frames[LEVELS];
+
+	explicit quality_controller(double fps);
+	// Takes the processing time of a frame and returns true if the level
+	// changed.
+	bool update(double ms);
+	const quality_level& current() const
+	{
+		return levels[level];
+	}
+};
+
+}
+
+#endif // QUALITY_H
@@ -0,0 +1,347 @@
+#include "raw_video.h"
+#include "config.h"
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#ifdef CAN_MMAP
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace cv;
+
+static const char y4m_magic[] = "YUV4MPEG2 ";
+static const char y4m_frame[] = "FRAME";
+// longest stream or frame header accepted
+static const std::size_t MAX_HEADER = 1024;
+// size of the stdio buffer of the writer
+static const std::size_t WRITE_BUFFER = 8 << 20;
+
+static bool has_extension(const std::string& file, const std::string& ext)
+{
+	return file.size() > ext.size() &&
+		file.compare(file.size()-ext.size(), ext.size(), ext) == 0;
+}
+
+bool flutter::raw_video_format_of(const std::string& file,
+	raw_video_format& format)
+{
+	if (has_extension(file, ".y4m")) {
+		format = y4m_format;
+		return true;
+	}
+	if (has_extension(file, ".yuv")) {
+		format = i420_format;
+		return true;
+	}
+	return false;
+}
+
+flutter::raw_video_capture::raw_video_capture(const std::string& name,
+	raw_video_format format, Size size, double fps):
+	format(format),
+	size(size),
+	fps(fps),
+	frame_bytes(0),
+	header_bytes(0),
+	offset(0),
+	frame_count(0),
+	fd(-1),
+	data(0),
+	file_size(0),
+	file(0)
+{
+	if (!open(name))
+		close();
+}
+
+flutter::raw_video_capture::~raw_video_capture()
+{
+	close();
+}
+
+bool flutter::raw_video_capture::open(const std::string& name)
+{
+#ifdef CAN_MMAP
+	fd = ::open(name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+	file_size = st.st_size;
+	if (file_size > 0) {
+		void* p = mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			data = static_cast<unsigned char*>(p);
+			madvise(p, file_size, MADV_SEQUENTIAL);
+		}
+	}
+#endif
+	if (!data) {
+		file = std::fopen(name.c_str(), "rb");
+		if (!file || std::fseek(file, 0, SEEK_END) != 0)
+			return false;
+		file_size = std::ftell(file);
+		std::rewind(file);
+	}
+	if (format == y4m_format) {
+		char line[MAX_HEADER];
+		std::size_t n = MIN(file_size, MAX_HEADER);
+		if (data)
+			std::memcpy(line, data, n);
+		else if (std::fread(line, 1, n, file) != n)
+			return false;
+		if (!parse_header(line, n))
+			return false;
+	}
+	if (size.width <= 0 || size.height <= 0 ||
+			size.width % 2 || size.height % 2)
+		return false;
+	frame_bytes = size.area()*3/2;
+	offset = header_bytes;
+	if (format != y4m_format) {
+		frame_count = (file_size - header_bytes)/frame_bytes;
+		return true;
+	}
+	// the frame headers may have parameters, so count them one by one
+	std::size_t at = header_bytes, start;
+	while (frame_start(at, start) && start + frame_bytes <= file_size) {
+		++frame_count;
+		at = start + frame_bytes;
+	}
+	return true;
+}
+
+bool flutter::raw_video_capture::parse_header(const char* line,
+	std::size_t n)
+{
+	std::size_t magic = sizeof(y4m_magic) - 1;
+	const char* end = static_cast<const char*>(std::memchr(line, '\n', n));
+	if (!end || n < magic || std::memcmp(line, y4m_magic, magic) != 0)
+		return false;
+	header_bytes = end - line + 1;
+	std::istringstream tokens(std::string(line + magic, end));
+	std::string t;
+	while (tokens >> t) {
+		switch (t[0]) {
+		case 'W':
+			size.width = std::atoi(t.c_str() + 1);
+			break;
+		case 'H':
+			size.height = std::atoi(t.c_str() + 1);
+			break;
+		case 'F': {
+			int num = 0, den = 0;
+			if (std::sscanf(t.c_str() + 1, "%d:%d", &num, &den) == 2 &&
+					num > 0 && den > 0)
+				fps = static_cast<double>(num)/den;
+			break;
+		}
+		case 'C':
+			// 8-bit 4:2:0 only, not 420p10 and the like
+			if (t != "C420" && t != "C420jpeg" && t != "C420paldv" &&
+					t != "C420mpeg2")
+				return false;
+			break;
+		case 'I':
+			// only progressive frames
+			if (t != "Ip" && t != "I?")
+				return false;
+			break;
+		}
+	}
+	return true;
+}
+
+bool flutter::raw_video_capture::frame_start(std::size_t at,
+	std::size_t& start)
+{
+	start = at;
+	if (format != y4m_format)
+		return true;
+	if (file && std::fseek(file, at, SEEK_SET) != 0)
+		return false;
+	char line[MAX_HEADER];
+	std::size_t n = MIN(file_size - at, MAX_HEADER);
+	const char* header = line;
+	if (data)
+		header = reinterpret_cast<const char*>(data + at);
+	else if (std::fread(line, 1, n, file) != n)
+		return false;
+	// FRAME may be followed by parameters up to the newline
+	std::size_t magic = sizeof(y4m_frame) - 1;
+	const char* end = static_cast<const char*>(std::memchr(header, '\n', n));
+	if (!end || n < magic || std::memcmp(header, y4m_frame, magic) != 0)
+		return false;
+	start += end - header + 1;
+	return true;
+}
+
+bool flutter::raw_video_capture::next_frame(Mat& image)
+{
+	std::size_t start;
+	if (!frame_start(offset, start) || start + frame_bytes > file_size)
+		return false;
+	offset = start + frame_bytes;
+	if (data) {
+		image = Mat(size.height*3/2, size.width, CV_8UC1, data + start);
+		return true;
+	}
+	image.create(size.height*3/2, size.width, CV_8UC1);
+	return std::fseek(file, start, SEEK_SET) == 0 &&
+		std::fread(image.data, 1, frame_bytes, file) == frame_bytes;
+}
+
+void flutter::raw_video_capture::close()
+{
+#ifdef CAN_MMAP
+	if (data)
+		munmap(data, file_size);
+	if (fd >= 0)
+		::close(fd);
+#endif
+	if (file)
+		std::fclose(file);
+	data = 0;
+	fd = -1;
+	file = 0;
+	frame_bytes = 0;
+}
+
+bool flutter::raw_video_capture::isOpened() const
+{
+	return frame_bytes > 0;
+}
+
+#if CV_MAJOR_VERSION < 3
+bool flutter::raw_video_capture::read(Mat& image)
+{
+	return isOpened() && next_frame(image);
+}
+#else
+bool flutter::raw_video_capture::read(OutputArray out)
+{
+	if (!isOpened())
+		return false;
+	if (out.kind() == _InputArray::MAT)
+		return next_frame(out.getMatRef());
+	Mat image;
+	if (!next_frame(image))
+		return false;
+	image.copyTo(out);
+	return true;
+}
+#endif
+
+// Skips a frame without reading it.
+bool flutter::raw_video_capture::grab()
+{
+	std::size_t start;
+	if (!isOpened() || !frame_start(offset, start) ||
+			start + frame_bytes > file_size)
+		return false;
+	offset = start + frame_bytes;
+	return true;
+}
+
+#if CV_MAJOR_VERSION < 3
+double flutter::raw_video_capture::get(int prop)
+#else
+double flutter::raw_video_capture::get(int prop) const
+#endif
+{
+	switch (prop) {
+	case CV_CAP_PROP_FRAME_WIDTH:
+		return size.width;
+	case CV_CAP_PROP_FRAME_HEIGHT:
+		return size.height;
+	case CV_CAP_PROP_FPS:
+		return fps;
+	case CV_CAP_PROP_FRAME_COUNT:
+		return frame_count;
+	case CV_CAP_PROP_FOURCC:
+		return CV_FOURCC('I','4','2','0');
+	}
+	return 0;
+}
+
+bool flutter::raw_video_capture::set(int, double)
+{
+	return false;
+}
+
+flutter::raw_video_writer::raw_video_writer(const std::string& name,
+	raw_video_format format, double fps, Size size):
+	format(format),
+	size(size),
+	file(std::fopen(name.c_str(), "wb")),
+	buffer(WRITE_BUFFER)
+{
+	if (!file)
+		return;
+	std::setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+	if (size.width % 2 || size.height % 2) {
+		std::fclose(file);
+		file = 0;
+		return;
+	}
+	if (format == y4m_format) {
+		// frame rates like 29.97 are multiples of 1000/1001
+		int num = cvRound(fps), den = 1;
+		if (std::abs(fps - num) > 1e-3) {
+			num = cvRound(fps*1001);
+			den = 1001;
+			if (std::abs(fps - num/1001.0) > 1e-3) {
+				num = cvRound(fps*1000);
+				den = 1000;
+			}
+		}
+		std::fprintf(file, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n",
+			size.width, size.height, num, den);
+	}
+}
+
+flutter::raw_video_writer::~raw_video_writer()
+{
+	if (file)
+		std::fclose(file);
+}
+
+bool flutter::raw_video_writer::isOpened() const
+{
+	return file != 0;
+}
+
+#if CV_MAJOR_VERSION < 4
+void flutter::raw_video_writer::write(const Mat& image)
+#else
+void flutter::raw_video_writer::write(InputArray src)
+#endif
+{
+#if CV_MAJOR_VERSION >= 4
+	Mat image = src.getMat();
+#endif
+	if (!file)
+		return;
+	const Mat* frame = &image;
+	if (image.type() == CV_8UC3) {
+		CV_Assert(image.size() == size);
+		cvtColor(image, i420, CV_BGR2YUV_I420);
+		frame = &i420;
+	}
+	CV_Assert(frame->type() == CV_8UC1 &&
+		frame->cols == size.width && frame->rows == size.height*3/2);
+	if (format == y4m_format)
+		std::fputs("FRAME\n", file);
+	if (frame->isContinuous()) {
+		std::fwrite(frame->data, 1, frame->total(), file);
+	} else {
+		for (int i = 0; i < frame->rows; ++i)
+			std::fwrite(frame->ptr(i), 1, frame->cols, file);
+	}
+}
@@ -0,0 +1,94 @@
+#ifndef RAW_VIDEO_H
+#define RAW_VIDEO_H
+
+#include <opencv2/opencv.hpp>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace flutter {
+
+enum raw_video_format {
+	// YUV4MPEG2 with 4:2:0 chroma
+	y4m_format,
+	// headerless I420 frames
+	i420_format
+};
+
+// The format of a raw video file by its extension, .y4m or .yuv.
+bool raw_video_format_of(const std::string& file, raw_video_format& format);
+
+// Reads uncompressed 4:2:0 video without a codec. The frames are
+// single channel I420 images with height*3/2 rows, as produced by
+// cvtColor(src, dst, CV_BGR2YUV_I420), and both dimensions are even.
+//
+// The file is memory mapped if possible and each frame is a matrix
+// header into the mapping, valid for the lifetime of the capture. The
+// mapping is read-only, so the frames must not be written to.
+struct raw_video_capture: public cv::VideoCapture {
+	raw_video_format format;
+	cv::Size size;
+	double fps;
+	std::size_t frame_bytes;
+	std::size_t header_bytes;
+	std::size_t offset;
+	int frame_count;
+	int fd;
+	unsigned char* data;
+	std::size_t file_size;
+	// used if the file cannot be mapped
+	std::FILE* file;
+
+	// The size and the frame rate are only needed for headerless files.
+	raw_video_capture(const std::string& name, raw_video_format format,
+		cv::Size size = cv::Size(), double fps = 0);
+	~raw_video_capture();
+	raw_video_capture(const raw_video_capture&) = delete;
+	raw_video_capture& operator=(const raw_video_capture&) = delete;
+
+	bool isOpened() const;
+	bool grab();
+#if CV_MAJOR_VERSION < 3
+	bool read(cv::Mat& image);
+	double get(int prop);
+#else
+	bool read(cv::OutputArray image);
+	double get(int prop) const;
+#endif
+	bool set(int prop, double value);
+
+	bool open(const std::string& name);
+	bool parse_header(const char* line, std::size_t n);
+	// Finds the data of the frame whose header starts at the offset.
+	bool frame_start(std::size_t at, std::size_t& start);
+	bool next_frame(cv::Mat& image);
+	void close();
+};
+
+// Writes uncompressed 4:2:0 video in large sequential writes. Accepts
+// BGR images, which are converted, or I420 images, which are written as
+// they are.
+struct raw_video_writer: public cv::VideoWriter {
+	raw_video_format format;
+	cv::Size size;
+	std::FILE* file;
+	std::vector<char> buffer;
+	cv::Mat i420;
+
+	raw_video_writer(const std::string& name, raw_video_format format,
+		double fps, cv::Size size);
+	~raw_video_writer();
+	raw_video_writer(const raw_video_writer&) = delete;
+	raw_video_writer& operator=(const raw_video_writer&) = delete;
+
+	bool isOpened() const;
+#if CV_MAJOR_VERSION < 4
+	void write(const cv::Mat& image);
+#else
+	void write(cv::InputArray image);
+#endif
+};
+
+}
+
+#endif // RAW_VIDEO_H
@@ -1,11 +1,56 @@
 // From lkpyramid.cpp
 
 #include "registration.h"
+#include "downscale.h"
+#include "phase_correlation.h"
+#include "small_lk.h"
 #include <opencv2/opencv.hpp>
 #include <cstring>
+#include <cmath>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 
 using namespace cv;
 
+flutter::registration_params::registration_params():
+	ransac_good_ratio(0.5),
+	ransac_threshold(0.05),
+	coarse_to_fine(false),
+	lk_levels(3),
+	lk_iterations(40),
+	grid_points(15),
+	ransac_iterations(500),
+	mask_coverage(1),
+	pool(0),
+	cache(0),
+	lk(0)
+{
+}
+
+void flutter::registration_params::set_mask(const cv::Mat& m)
+{
+	mask = m;
+	mask_coverage = m.empty() ? 1 : (double)countNonZero(m)/m.total();
+}
+
+flutter::registration_params flutter::guided_params(
+	const registration_params& params, double error)
+{
+	// about one and four pixels at the default resolution
+	const double SMALL_ERROR = 0.006, MEDIUM_ERROR = 0.025;
+
+	registration_params p(params);
+	if (error < SMALL_ERROR) {
+		p.lk_levels = MIN(p.lk_levels, 1);
+		p.lk_iterations = MIN(p.lk_iterations, 10);
+	} else if (error < MEDIUM_ERROR) {
+		p.lk_levels = MIN(p.lk_levels, 2);
+		p.lk_iterations = MIN(p.lk_iterations, 20);
+	}
+	return p;
+}
+
 static void
 get_rt_matrix(const CvPoint2D32f* a, const CvPoint2D32f* b,
 	int count, CvMat* M)
@@ -56,28 +101,196 @@ get_rt_matrix(const CvPoint2D32f* a, const CvPoint2D32f* b,
 	om[5] = m[3];
 }
 
-static int estimate_rigid_transform_detail(const CvArr* matA, const CvArr* matB,
-	CvMat* matM, double ransac_good_ratio, double ransac_threshold)
+// Size of an image downscaled to approximately width x height while
+// preserving the aspect ratio, and the corresponding scale.
+static CvSize downscaled_size(CvSize size, int width, int height, double& scale)
 {
-	const int COUNT = 15;
-	const int WIDTH = 160, HEIGHT = 120;
-	const int RANSAC_MAX_ITERS = 500;
-	const int RANSAC_SIZE0 = 3;
+	scale = MAX((double)width/size.width, (double)height/size.height);
+	scale = MIN(scale, 1.);
+	return cvSize(cvRound(size.width * scale), cvRound(size.height * scale));
+}
+
+// The downscaled gray version of the image, from the cache if it holds it.
+static Mat downscale_cached(const Mat& src, Size size,
+	const flutter::registration_params& params)
+{
+	flutter::downscale_cache* cache = params.cache;
+	for (int i = 0; cache && i < 2; ++i) {
+		if (cache->source[i].data == src.data &&
+				cache->source[i].size() == src.size() &&
+				cache->image[i].size() == size)
+			return cache->image[i];
+	}
+	Mat dst;
+	flutter::downscale_gray(src, dst, size, params.pool);
+	return dst;
+}
+
+static void store_downscaled(const Mat& A, const Mat& sA, const Mat& B,
+	const Mat& sB, const flutter::registration_params& params)
+{
+	flutter::downscale_cache* cache = params.cache;
+	if (!cache)
+		return;
+	cache->source[0] = A;
+	cache->image[0] = sA;
+	cache->source[1] = B;
+	cache->image[1] = sB;
+}
+
+static const int RANSAC_MAX_ITERS = 500;
+static const int RANSAC_SIZE0 = 3;
+// minimum number of points per optical flow block
+static const int LK_BLOCK_MIN = 32;
+// the grid is refined, up to the given factor, to keep about this many
+// points inside a registration mask
+static const int MASK_MIN_POINTS = 100;
+static const double MASK_MAX_DENSITY = 4;
+
+// Runs OpenCV single threaded while in scope, for calls within the tasks of
+// the pool, and restores its thread count for the rest of the program.
+struct serial_opencv {
+	int threads;
+
+	serial_opencv():
+		threads(getNumThreads())
+	{
+		setNumThreads(1);
+	}
+	~serial_opencv()
+	{
+		setNumThreads(threads);
+	}
+};
+
+// Seed of the random sequence of RANSAC hypothesis k. Consecutive seeds
+// give correlated sequences, so k is mixed with splitmix64 first.
+static std::uint64_t ransac_seed(int k)
+{
+	std::uint64_t z = static_cast<std::uint64_t>(k) + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
 
-	cv::Ptr<CvMat> sA, sB;
+// Evaluates RANSAC hypothesis k. The sample is drawn from a random
+// sequence determined by k alone, so the result does not depend on the
+// thread evaluating it. Returns false if no acceptable sample was found.
+static bool ransac_hypothesis(int k, const CvPoint2D32f* pA,
+	const CvPoint2D32f* pB, int count, double max_dist,
+	int* good_idx, int& good_count, double* m)
+{
+	CvRNG rng = cvRNG(ransac_seed(k));
+	CvMat M = cvMat(2, 3, CV_64F, m);
+	int idx[RANSAC_SIZE0];
+	CvPoint2D32f a[3];
+	CvPoint2D32f b[3];
+	int i, j, k1;
+
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+
+	// choose random 3 non-complanar points from A & B
+	for (i = 0; i < RANSAC_SIZE0; i++) {
+		for (k1 = 0; k1 < RANSAC_MAX_ITERS; k1++) {
+			idx[i] = cvRandInt(&rng) % count;
+
+			for (j = 0; j < i; j++) {
+				if (idx[j] == idx[i]) {
+					break;
+				}
+				// check that the points are not very close one each other
+				if (fabs(pA[idx[i]].x - pA[idx[j]].x) +
+				                fabs(pA[idx[i]].y - pA[idx[j]].y) < FLT_EPSILON) {
+					break;
+				}
+				if (fabs(pB[idx[i]].x - pB[idx[j]].x) +
+				                fabs(pB[idx[i]].y - pB[idx[j]].y) < FLT_EPSILON) {
+					break;
+				}
+			}
+
+			if (j < i) {
+				continue;
+			}
+
+			if (i+1 == RANSAC_SIZE0) {
+				// additional check for non-complanar vectors
+				a[0] = pA[idx[0]];
+				a[1] = pA[idx[1]];
+				a[2] = pA[idx[2]];
+
+				b[0] = pB[idx[0]];
+				b[1] = pB[idx[1]];
+				b[2] = pB[idx[2]];
+
+				double dax1 = a[1].x - a[0].x, day1 = a[1].y - a[0].y;
+				double dax2 = a[2].x - a[0].x, day2 = a[2].y - a[0].y;
+				double dbx1 = b[1].x - b[0].x, dby1 = b[1].y - b[0].y;
+				double dbx2 = b[2].x - b[0].x, dby2 = b[2].y - b[0].y;
+				const double eps = 0.01;
+
+				if (fabs(dax1*day2 - day1*dax2) < eps*sqrt(dax1*dax1+day1*day1)*sqrt(dax2*dax2+day2*day2) ||
+				                fabs(dbx1*dby2 - dby1*dbx2) < eps*sqrt(dbx1*dbx1+dby1*dby1)*sqrt(dbx2*dbx2+dby2*dby2)) {
+					continue;
+				}
+			}
+			break;
+		}
+
+		if (k1 >= RANSAC_MAX_ITERS) {
+			return false;
+		}
+	}
+
+	// estimate the transformation using 3 points
+	get_rt_matrix(a, b, 3, &M);
+
+	for (i = 0, good_count = 0; i < count; i++) {
+		if (fabs(m[0]*pA[i].x + m[1]*pA[i].y + m[2] - pB[i].x) +
+		                fabs(m[3]*pA[i].x + m[4]*pA[i].y + m[5] - pB[i].y) < max_dist) {
+			good_idx[good_count++] = i;
+		}
+	}
+	return true;
+}
+
+// Records the differences of the small LK tracker to calcOpticalFlowPyrLK.
+static void compare_lk(const Mat& pts, const Mat& st, const Mat& ref_pts,
+	const Mat& ref_st, flutter::lk_validation& v)
+{
+	for (int i = 0; i < pts.cols; ++i) {
+		bool found = st.at<uchar>(i), ref_found = ref_st.at<uchar>(i);
+		if (found != ref_found) {
+			++v.status_mismatches;
+		} else if (found) {
+			double e = norm(pts.at<Point2f>(i) - ref_pts.at<Point2f>(i));
+			v.sum_error += e;
+			v.max_error = MAX(v.max_error, e);
+			++v.compared;
+		}
+		++v.points;
+	}
+}
+
+// guess is an optional initial estimate of the transformation in the
+// coordinates of the original images
+static int estimate_rigid_transform_detail(const Mat& matA, const Mat& matB,
+	CvMat* matM, const flutter::registration_params& params,
+	CvSize size, int levels, const double* guess)
+{
+	Mat sA, sB;
 	cv::AutoBuffer<CvPoint2D32f> pA, pB;
 	cv::AutoBuffer<int> good_idx;
 	cv::AutoBuffer<char> status;
-	cv::Ptr<CvMat> gray;
 
-	CvMat stubA, *A = cvGetMat(matA, &stubA);
-	CvMat stubB, *B = cvGetMat(matB, &stubB);
+	CvMat stubA = matA, *A = &stubA;
+	CvMat stubB = matB, *B = &stubB;
 	CvSize sz0, sz1;
 	int cn, equal_sizes;
-	int i, j, k, k1;
+	int i, j, k;
 	int count_x, count_y, count = 0;
 	double scale = 1;
-	CvRNG rng = cvRNG(-1);
 	double m[6]= {0};
 	CvMat M = cvMat(2, 3, CV_64F, m);
 	int good_count = 0;
@@ -98,37 +311,39 @@ static int estimate_rigid_transform_detail(const CvArr* matA, const CvArr* matB,
 	if (CV_MAT_TYPE(A->type) == CV_8UC1 || CV_MAT_TYPE(A->type) == CV_8UC3) {
 		cn = CV_MAT_CN(A->type);
 		sz0 = cvGetSize(A);
-		sz1 = cvSize(WIDTH, HEIGHT);
-
-		scale = MAX((double)sz1.width/sz0.width, (double)sz1.height/sz0.height);
-		scale = MIN(scale, 1.);
-		sz1.width = cvRound(sz0.width * scale);
-		sz1.height = cvRound(sz0.height * scale);
+		sz1 = downscaled_size(sz0, size.width, size.height, scale);
 
 		equal_sizes = sz1.width == sz0.width && sz1.height == sz0.height;
 
 		if (!equal_sizes || cn != 1) {
-			sA = cvCreateMat(sz1.height, sz1.width, CV_8UC1);
-			sB = cvCreateMat(sz1.height, sz1.width, CV_8UC1);
-
-			if (cn != 1) {
-				gray = cvCreateMat(sz0.height, sz0.width, CV_8UC1);
-				cvCvtColor(A, gray, CV_BGR2GRAY);
-				cvResize(gray, sA, CV_INTER_AREA);
-				cvCvtColor(B, gray, CV_BGR2GRAY);
-				cvResize(gray, sB, CV_INTER_AREA);
-				gray.release();
-			} else {
-				cvResize(A, sA, CV_INTER_AREA);
-				cvResize(B, sB, CV_INTER_AREA);
-			}
-
-			A = sA;
-			B = sB;
+			// the conversion to gray is fused with the downscaling,
+			// and the first image is usually the second one of the
+			// previous registration or both were just tested for
+			// motion
+			sA = downscale_cached(matA, sz1, params);
+			sB = downscale_cached(matB, sz1, params);
+			store_downscaled(matA, sA, matB, sB, params);
+
+			stubA = sA;
+			stubB = sB;
 		}
 
-		count_y = COUNT;
-		count_x = cvRound((double)COUNT*sz1.width/sz1.height);
+		count_y = params.grid_points;
+		count_x = cvRound((double)count_y*sz1.width/sz1.height);
+		const Mat& mask = params.mask;
+		if (!mask.empty()) {
+			CV_Assert(mask.type() == CV_8UC1 &&
+				mask.cols == sz0.width && mask.rows == sz0.height);
+			if (params.mask_coverage <= 0)
+				return 0;
+			double density = std::sqrt(MASK_MIN_POINTS /
+				(params.mask_coverage*count_x*count_y));
+			density = MIN(density, MASK_MAX_DENSITY);
+			if (density > 1) {
+				count_x = cvCeil(count_x*density);
+				count_y = cvCeil(count_y*density);
+			}
+		}
 		count = count_x * count_y;
 
 		pA.allocate(count);
@@ -136,14 +351,79 @@ static int estimate_rigid_transform_detail(const CvArr* matA, const CvArr* matB,
 		status.allocate(count);
 
 		for (i = 0, k = 0; i < count_y; i++)
-			for (j = 0; j < count_x; j++, k++) {
-				pA[k].x = (j+0.5f)*sz1.width/count_x;
-				pA[k].y = (i+0.5f)*sz1.height/count_y;
+			for (j = 0; j < count_x; j++) {
+				float x = (j+0.5f)*sz1.width/count_x;
+				float y = (i+0.5f)*sz1.height/count_y;
+				if (!mask.empty() && !mask.at<uchar>(
+						MIN(cvFloor(y/scale), mask.rows-1),
+						MIN(cvFloor(x/scale), mask.cols-1)))
+					continue;
+				pA[k].x = x;
+				pA[k].y = y;
+				k++;
+			}
+		count = k;
+		if (count < RANSAC_SIZE0)
+			return 0;
+
+		int flags = 0;
+		if (guess) {
+			for (k = 0; k < count; k++) {
+				pB[k].x = guess[0]*pA[k].x + guess[1]*pA[k].y + guess[2]*scale;
+				pB[k].y = guess[3]*pA[k].x + guess[4]*pA[k].y + guess[5]*scale;
 			}
+			flags |= OPTFLOW_USE_INITIAL_FLOW;
+		}
 
-		// find the corresponding points in B
-		cvCalcOpticalFlowPyrLK(A, B, 0, 0, pA, pB, count, cvSize(10,10), 3,
-		                       status, 0, cvTermCriteria(CV_TERMCRIT_ITER,40,0.1), 0);
+		// find the corresponding points in B, in blocks of points that
+		// share the pyramids
+		Size win(10, 10);
+		Mat imgA = cv::cvarrToMat(A), imgB = cv::cvarrToMat(B);
+		flutter::small_lk* lk = params.lk;
+		bool small = lk && imgA.type() == CV_8UC1 &&
+			flutter::small_lk::supports(imgA.size(), levels, win);
+		Mat ptsA(1, count, CV_32FC2, (float*)pA);
+		Mat ptsB(1, count, CV_32FC2, (float*)pB);
+		Mat st(1, count, CV_8U, (uchar*)(char*)status);
+		Mat initial;
+		if (small && lk->validate)
+			ptsB.copyTo(initial);
+		TermCriteria criteria(TermCriteria::COUNT, params.lk_iterations, 0.1);
+		std::vector<Mat> pyrA, pyrB;
+		int cv_levels = levels;
+		if (!small || lk->validate) {
+			cv_levels = buildOpticalFlowPyramid(imgA, pyrA, win, levels, true);
+			buildOpticalFlowPyramid(imgB, pyrB, win, cv_levels, false);
+		}
+		if (small)
+			lk->build(imgA, imgB, levels);
+		int blocks = params.pool ? MIN(params.pool->size(), count/LK_BLOCK_MIN) : 1;
+		blocks = MAX(blocks, 1);
+		auto track = [&](int b) {
+			Range r(b*count/blocks, (b+1)*count/blocks);
+			if (small) {
+				lk->track(ptsA.ptr<Point2f>() + r.start,
+					ptsB.ptr<Point2f>() + r.start, st.data + r.start,
+					r.size(), params.lk_iterations, guess != 0);
+				return;
+			}
+			Mat a = ptsA.colRange(r), n = ptsB.colRange(r), s = st.colRange(r);
+			calcOpticalFlowPyrLK(pyrA, pyrB, a, n, s, noArray(), win,
+				cv_levels, criteria, flags);
+		};
+		if (blocks > 1) {
+			// calcOpticalFlowPyrLK would start its own threads
+			serial_opencv serial;
+			params.pool->parallel_for(blocks, track);
+		} else {
+			track(0);
+		}
+		if (small && lk->validate) {
+			Mat st_cv(1, count, CV_8U);
+			calcOpticalFlowPyrLK(pyrA, pyrB, ptsA, initial, st_cv, noArray(),
+				win, cv_levels, criteria, flags);
+			compare_lk(ptsB, st, initial, st_cv, lk->validation);
+		}
 
 		// repack the remained points
 		for (i = 0, k = 0; i < count; i++)
@@ -179,90 +459,35 @@ static int estimate_rigid_transform_detail(const CvArr* matA, const CvArr* matB,
 	brect = cvBoundingRect(&_pB, 1);
 
 	// RANSAC stuff:
-	// 1. find the consensus
-	for (k = 0; k < RANSAC_MAX_ITERS; k++) {
-		int idx[RANSAC_SIZE0];
-		CvPoint2D32f a[3];
-		CvPoint2D32f b[3];
-
-		memset(a, 0, sizeof(a));
-		memset(b, 0, sizeof(b));
-
-		// choose random 3 non-complanar points from A & B
-		for (i = 0; i < RANSAC_SIZE0; i++) {
-			for (k1 = 0; k1 < RANSAC_MAX_ITERS; k1++) {
-				idx[i] = cvRandInt(&rng) % count;
-
-				for (j = 0; j < i; j++) {
-					if (idx[j] == idx[i]) {
-						break;
-					}
-					// check that the points are not very close one each other
-					if (fabs(pA[idx[i]].x - pA[idx[j]].x) +
-					                fabs(pA[idx[i]].y - pA[idx[j]].y) < FLT_EPSILON) {
-						break;
-					}
-					if (fabs(pB[idx[i]].x - pB[idx[j]].x) +
-					                fabs(pB[idx[i]].y - pB[idx[j]].y) < FLT_EPSILON) {
-						break;
-					}
-				}
-
-				if (j < i) {
-					continue;
-				}
-
-				if (i+1 == RANSAC_SIZE0) {
-					// additional check for non-complanar vectors
-					a[0] = pA[idx[0]];
-					a[1] = pA[idx[1]];
-					a[2] = pA[idx[2]];
-
-					b[0] = pB[idx[0]];
-					b[1] = pB[idx[1]];
-					b[2] = pB[idx[2]];
-
-					double dax1 = a[1].x - a[0].x, day1 = a[1].y - a[0].y;
-					double dax2 = a[2].x - a[0].x, day2 = a[2].y - a[0].y;
-					double dbx1 = b[1].x - b[0].x, dby1 = b[1].y - b[0].y;
-					double dbx2 = b[2].x - b[0].x, dby2 = b[2].y - b[0].y;
-					const double eps = 0.01;
-
-					if (fabs(dax1*day2 - day1*dax2) < eps*sqrt(dax1*dax1+day1*day1)*sqrt(dax2*dax2+day2*day2) ||
-					                fabs(dbx1*dby2 - dby1*dbx2) < eps*sqrt(dbx1*dbx1+dby1*dby1)*sqrt(dbx2*dbx2+dby2*dby2)) {
-						continue;
-					}
-				}
-				break;
-			}
-
-			if (k1 >= RANSAC_MAX_ITERS) {
-				break;
-			}
-		}
-
-		if (i < RANSAC_SIZE0) {
-			continue;
-		}
-
-		// estimate the transformation using 3 points
-		get_rt_matrix(a, b, 3, &M);
-
-		for (i = 0, good_count = 0; i < count; i++) {
-			if (fabs(m[0]*pA[i].x + m[1]*pA[i].y + m[2] - pB[i].x) +
-			                fabs(m[3]*pA[i].x + m[4]*pA[i].y + m[5] - pB[i].y) < MAX(brect.width,brect.height)*ransac_threshold) {
-				good_idx[good_count++] = i;
-			}
-		}
-
-		if (good_count >= count*ransac_good_ratio) {
+	// 1. find the consensus, the hypothesis with the lowest index that
+	// reaches it wins. Each thread evaluates every n:th hypothesis and
+	// stops at the best found so far.
+	double max_dist = MAX(brect.width,brect.height)*params.ransac_threshold;
+	int min_good = cvCeil(count*params.ransac_good_ratio);
+	int threads = params.pool ? params.pool->size() : 1;
+	std::atomic<int> best(params.ransac_iterations);
+	auto search = [&](int t) {
+		cv::AutoBuffer<int> idx(count);
+		double mm[6];
+		int n;
+		for (int h = t; h < best; h += threads) {
+			if (!ransac_hypothesis(h, pA, pB, count, max_dist, idx, n, mm) ||
+					n < min_good)
+				continue;
+			int cur = best;
+			while (h < cur && !best.compare_exchange_weak(cur, h));
 			break;
 		}
-	}
+	};
+	if (threads > 1)
+		params.pool->parallel_for(threads, search);
+	else
+		search(0);
 
-	if (k >= RANSAC_MAX_ITERS) {
+	if (best >= params.ransac_iterations) {
 		return 0;
 	}
+	ransac_hypothesis(best, pA, pB, count, max_dist, good_idx, good_count, m);
 
 	if (good_count < count) {
 		for (i = 0; i < good_count; i++) {
@@ -280,16 +505,120 @@ static int estimate_rigid_transform_detail(const CvArr* matA, const CvArr* matB,
 	return 1;
 }
 
+// Estimates the global translation between very small versions of
+// the images with phase correlation.
+static bool estimate_coarse_translation(const Mat& A, const Mat& B,
+	const flutter::registration_params& params, Point2d& t)
+{
+	const int WIDTH = 80, HEIGHT = 60;
+	const double MIN_RESPONSE = 0.05;
+
+	double scale;
+	CvSize sz = downscaled_size(A.size(), WIDTH, HEIGHT, scale);
+	Mat sA, sB;
+	flutter::downscale_gray(A, sA, sz);
+	flutter::downscale_gray(B, sB, sz);
+	Mat window;
+	createHanningWindow(window, sz, CV_64F);
+	if (!params.mask.empty())
+		flutter::mask_window(window, params.mask);
+	double response;
+	t = flutter::phase_correlate(sA, sB, window, &response);
+	t.x /= scale;
+	t.y /= scale;
+	return response >= MIN_RESPONSE;
+}
+
 cv::Mat flutter::estimate_rigid_transform(cv::InputArray src1, cv::InputArray src2,
-	double ransac_good_ratio, double ransac_threshold)
+	const registration_params& params, cv::InputArray guess)
 {
+	const int WIDTH = 160, HEIGHT = 120;
+	// resolution used for large motions in coarse-to-fine mode
+	const int FINE_WIDTH = 320, FINE_HEIGHT = 240, FINE_LEVELS = 2;
+	// motion relative to the image dimensions considered large
+	const double LARGE_MOTION = 0.03;
+
 	Mat M(2, 3, CV_64F), A = src1.getMat(), B = src2.getMat();
-	CvMat matA = A, matB = B, matM = M;
-	int err = estimate_rigid_transform_detail(&matA, &matB, &matM,
-		ransac_good_ratio, ransac_threshold);
+	CvMat matM = M;
+	CvSize size = cvSize(WIDTH, HEIGHT);
+	int levels = params.lk_levels;
+	double g[6] = { 1, 0, 0, 0, 1, 0 };
+	Mat_<double> G(2, 3, g);
+	bool guided = !guess.empty();
+	Point2d t;
+	if (guided) {
+		guess.getMat().convertTo(G, CV_64F);
+	} else if (params.coarse_to_fine && A.depth() == CV_8U &&
+			estimate_coarse_translation(A, B, params, t)) {
+		guided = true;
+		g[2] = t.x;
+		g[5] = t.y;
+	}
+	if (guided && params.coarse_to_fine &&
+			(std::abs(g[2]) > LARGE_MOTION*A.cols ||
+			 std::abs(g[5]) > LARGE_MOTION*A.rows)) {
+		size = cvSize(FINE_WIDTH, FINE_HEIGHT);
+		levels = MIN(levels, FINE_LEVELS);
+	}
+	int err = estimate_rigid_transform_detail(A, B, &matM, params,
+		size, levels, guided ? g : 0);
 	if (err == 1) {
 		return M;
 	} else {
 		return Mat();
 	}
 }
+
+void flutter::mask_correspondences(const Mat& mask, Mat& src, Mat& dst)
+{
+	CV_Assert(mask.type() == CV_8UC1 && src.type() == CV_32FC2 &&
+		src.size() == dst.size() && src.rows == 1);
+	Mat s(1, src.cols, CV_32FC2), d(1, dst.cols, CV_32FC2);
+	int n = 0;
+	for (int i = 0; i < src.cols; ++i) {
+		Point2f p = src.at<Point2f>(i);
+		int x = cvFloor(p.x), y = cvFloor(p.y);
+		if (x < 0 || y < 0 || x >= mask.cols || y >= mask.rows ||
+				!mask.at<uchar>(y, x))
+			continue;
+		s.at<Point2f>(n) = p;
+		d.at<Point2f>(n) = dst.at<Point2f>(i);
+		++n;
+	}
+	src = n ? s.colRange(0, n) : Mat();
+	dst = n ? d.colRange(0, n) : Mat();
+}
+
+double flutter::sample_difference(cv::InputArray src1, cv::InputArray src2,
+	const registration_params& params)
+{
+	// the size of the images registered
+	const int WIDTH = 160, HEIGHT = 120;
+
+	Mat A = src1.getMat(), B = src2.getMat();
+	CV_Assert(A.size() == B.size() && A.type() == B.type() &&
+		A.depth() == CV_8U);
+	double scale;
+	Size size = downscaled_size(A.size(), WIDTH, HEIGHT, scale);
+	// each pixel is the average of a box of source pixels, which keeps
+	// the sensor noise out of the difference
+	Mat sA = downscale_cached(A, size, params);
+	Mat sB = downscale_cached(B, size, params);
+	store_downscaled(A, sA, B, sB, params);
+	const Mat& mask = params.mask;
+	int64 sum = 0;
+	int n = 0;
+	for (int y = 0; y < size.height; ++y) {
+		const uchar* a = sA.ptr<uchar>(y);
+		const uchar* b = sB.ptr<uchar>(y);
+		const uchar* m = mask.empty() ? 0 : mask.ptr<uchar>(
+			MIN(cvFloor((y + 0.5)/scale), mask.rows-1));
+		for (int x = 0; x < size.width; ++x) {
+			if (m && !m[MIN(cvFloor((x + 0.5)/scale), mask.cols-1)])
+				continue;
+			sum += std::abs(a[x] - b[x]);
+			++n;
+		}
+	}
+	return n ? (double)sum/n : 0;
+}
@@ -1,12 +1,69 @@
 #ifndef REGISTRATION_H
 #define REGISTRATION_H
 
+#include "small_lk.h"
+#include "task_pool.h"
 #include <opencv2/opencv.hpp>
 
 namespace flutter {
 
+// The downscaled gray versions of the two images of the latest
+// registration or static frame test, reused when the next one involves the
+// same images. The sources are held so that their buffers cannot be reused
+// while cached.
+struct downscale_cache {
+	cv::Mat source[2];
+	cv::Mat image[2];
+};
+
+struct registration_params {
+	double ransac_good_ratio;
+	double ransac_threshold;
+	// Estimate the global translation from a very small image first and
+	// use it as the initial guess for the optical flow.
+	bool coarse_to_fine;
+	int lk_levels;
+	int lk_iterations;
+	// rows of the grid of points tracked, the columns follow the aspect
+	// ratio
+	int grid_points;
+	int ransac_iterations;
+	// Points are only tracked where the mask, an 8-bit image of the size
+	// of the input images, is nonzero.
+	cv::Mat mask;
+	double mask_coverage;
+	// Optical flow, RANSAC and downscaling are split over the pool if
+	// given.
+	task_pool* pool;
+	// Optional, shared by all copies of the parameters.
+	downscale_cache* cache;
+	// Optional tracker used instead of calcOpticalFlowPyrLK where it
+	// applies, shared like the cache.
+	small_lk* lk;
+
+	registration_params();
+	void set_mask(const cv::Mat& mask);
+};
+
+// Parameters for registration with an initial guess that is expected to
+// be off by the given error relative to the image dimensions.
+registration_params guided_params(const registration_params& params,
+	double error);
+
+// The optional guess is an initial estimate of the 2x3 transformation,
+// it overrides the coarse estimate.
 cv::Mat estimate_rigid_transform(cv::InputArray src1, cv::InputArray src2,
-	double ransac_good_ratio, double ransac_threshold);
+	const registration_params& params, cv::InputArray guess = cv::noArray());
+
+// Keeps the point correspondences of the 1xN CV_32FC2 matrices whose
+// source point lies where the 8-bit mask is nonzero.
+void mask_correspondences(const cv::Mat& mask, cv::Mat& src, cv::Mat& dst);
+
+// Mean absolute difference of 8-bit images in the downscaled gray images
+// used for registration, where the mask of the parameters is nonzero. A
+// cheap test for whether there is any motion to register at all.
+double sample_difference(cv::InputArray src1, cv::InputArray src2,
+	const registration_params& params);
 
 }
 
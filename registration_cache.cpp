@@ -0,0 +1,219 @@
+#include "registration_cache.h"
+#include "config.h"
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#ifdef CAN_MMAP
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char cache_magic[8] = {'F','L','U','T','R','E','G','1'};
+
+struct flutter::registration_cache::header {
+	char magic[8];
+	uint64_t key;
+	int32_t capacity;
+	int32_t reserved;
+};
+
+struct flutter::registration_cache::entry {
+	enum { unknown = 0, registered = 1, failed = 2 };
+	int32_t status;
+	int32_t reserved;
+	double m[6];
+};
+
+static void fnv1a(uint64_t& h, const void* data, std::size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (std::size_t i = 0; i < size; ++i) {
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+}
+
+// Hash of the size and of the first and last megabytes of the file.
+static bool content_hash(const std::string& file, uint64_t& h)
+{
+	const std::streamoff CHUNK = 1 << 20;
+	std::ifstream in(file, std::ios::binary);
+	if (!in)
+		return false;
+	in.seekg(0, std::ios::end);
+	std::streamoff size = in.tellg();
+	fnv1a(h, &size, sizeof(size));
+	std::vector<char> buf(CHUNK);
+	in.seekg(0);
+	in.read(buf.data(), std::min(size, CHUNK));
+	fnv1a(h, buf.data(), in.gcount());
+	if (size > CHUNK) {
+		in.seekg(std::max(size - CHUNK, CHUNK));
+		in.read(buf.data(), CHUNK);
+		fnv1a(h, buf.data(), in.gcount());
+	}
+	return !in.bad();
+}
+
+uint64_t flutter::image_hash(const cv::Mat& image)
+{
+	uint64_t h = 14695981039346656037ull;
+	int header[3] = { image.rows, image.cols, image.type() };
+	fnv1a(h, header, sizeof(header));
+	for (int i = 0; i < image.rows; ++i)
+		fnv1a(h, image.ptr(i), image.cols*image.elemSize());
+	return h;
+}
+
+flutter::registration_cache::registration_cache():
+	fd(-1),
+	data(0),
+	size(0),
+	capacity(0),
+	hits(0),
+	misses(0)
+{
+}
+
+flutter::registration_cache::~registration_cache()
+{
+	close();
+}
+
+flutter::registration_cache::entry* flutter::registration_cache::entries() const
+{
+	return reinterpret_cast<entry*>(static_cast<char*>(data) + sizeof(header));
+}
+
+#ifdef CAN_MMAP
+
+bool flutter::registration_cache::open(const std::string& dir,
+	const std::string& input_file, const std::string& params, int frames)
+{
+	close();
+	uint64_t key = 14695981039346656037ull;
+	if (!content_hash(input_file, key))
+		return false;
+	fnv1a(key, params.data(), params.size());
+	std::ostringstream path;
+	path << dir << "/" << std::hex << std::setw(16) << std::setfill('0') <<
+		key << ".reg";
+	fd = ::open(path.str().c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 &&
+			static_cast<std::size_t>(st.st_size) >= sizeof(header)) {
+		header h;
+		if (pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+				!std::memcmp(h.magic, cache_magic, sizeof(cache_magic)) &&
+				h.key == key &&
+				st.st_size >= static_cast<off_t>(sizeof(header) +
+					h.capacity*sizeof(entry))) {
+			capacity = h.capacity;
+		}
+	}
+	if (!capacity && ftruncate(fd, 0) != 0) {
+		close();
+		return false;
+	}
+	if (!reserve(std::max(frames, 1))) {
+		close();
+		return false;
+	}
+	header* h = static_cast<header*>(data);
+	std::memcpy(h->magic, cache_magic, sizeof(cache_magic));
+	h->key = key;
+	return true;
+}
+
+bool flutter::registration_cache::reserve(int frames)
+{
+	if (data && frames <= capacity)
+		return true;
+	int n = std::max(frames, capacity);
+	std::size_t new_size = sizeof(header) + n*sizeof(entry);
+	if (data)
+		munmap(data, size);
+	data = 0;
+	// new entries read as zero, i.e. unknown
+	if (ftruncate(fd, new_size) != 0)
+		return false;
+	void* p = mmap(0, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+	data = p;
+	size = new_size;
+	capacity = n;
+	static_cast<header*>(data)->capacity = n;
+	return true;
+}
+
+void flutter::registration_cache::close()
+{
+	if (data)
+		munmap(data, size);
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	data = 0;
+	size = 0;
+	capacity = 0;
+}
+
+#else
+
+bool flutter::registration_cache::open(const std::string&,
+	const std::string&, const std::string&, int)
+{
+	return false;
+}
+
+bool flutter::registration_cache::reserve(int)
+{
+	return false;
+}
+
+void flutter::registration_cache::close()
+{
+}
+
+#endif
+
+bool flutter::registration_cache::lookup(int frame, cv::Mat& m)
+{
+	if (!data || frame < 0 || frame >= capacity ||
+			entries()[frame].status == entry::unknown) {
+		++misses;
+		return false;
+	}
+	const entry& e = entries()[frame];
+	if (e.status == entry::registered)
+		cv::Mat(2, 3, CV_64F, const_cast<double*>(e.m)).copyTo(m);
+	else
+		m.release();
+	++hits;
+	return true;
+}
+
+void flutter::registration_cache::store(int frame, const cv::Mat& m)
+{
+	if (!data || frame < 0)
+		return;
+	if (frame >= capacity && !reserve(std::max(frame+1, capacity*2)))
+		return;
+	entry& e = entries()[frame];
+	if (m.empty()) {
+		e.status = entry::failed;
+		return;
+	}
+	cv::Mat dst(2, 3, CV_64F, e.m);
+	m.convertTo(dst, CV_64F);
+	e.status = entry::registered;
+}
@@ -0,0 +1,56 @@
+#ifndef REGISTRATION_CACHE_H
+#define REGISTRATION_CACHE_H
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace flutter {
+
+// Registration results of an input file stored per frame in a
+// memory-mapped file. The file is named after a hash of the input
+// content and the registration parameters, so processing the same input
+// again with different filter settings does not register the frames
+// again.
+struct registration_cache {
+	struct header;
+	struct entry;
+
+	int fd;
+	void* data;
+	std::size_t size;
+	int capacity;
+	int hits;
+	int misses;
+
+	registration_cache();
+	~registration_cache();
+	registration_cache(const registration_cache&) = delete;
+	registration_cache& operator=(const registration_cache&) = delete;
+
+	// Opens or creates the cache file in dir. frames is the expected
+	// number of frames, the file grows as needed. Returns false if the
+	// input cannot be read or caching is not supported.
+	bool open(const std::string& dir, const std::string& input_file,
+		const std::string& params, int frames);
+	bool is_open() const
+	{
+		return data != 0;
+	}
+	// Returns true if frame has been registered, m is the resulting 2x3
+	// transformation or empty if the registration failed.
+	bool lookup(int frame, cv::Mat& m);
+	void store(int frame, const cv::Mat& m);
+	void close();
+	bool reserve(int frames);
+	entry* entries() const;
+};
+
+// Hash of the size and the pixels of an image, e.g. of a mask that is part
+// of the parameters.
+std::uint64_t image_hash(const cv::Mat& image);
+
+}
+
+#endif // REGISTRATION_CACHE_H
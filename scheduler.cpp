@@ -0,0 +1,56 @@
+#include "scheduler.h"
+#include "config.h"
+#include <chrono>
+#include <thread>
+#ifdef CAN_CLOCK_NANOSLEEP
+#include <cerrno>
+#include <time.h>
+#endif
+
+flutter::frame_scheduler::frame_scheduler(double fps, late_policy policy):
+	period(fps > 0 ? static_cast<int64_t>(1e9/fps) : 0),
+	deadline(0),
+	policy(policy)
+{
+}
+
+int flutter::frame_scheduler::wait()
+{
+	int64_t t = now();
+	if (!deadline) {
+		deadline = t + period;
+		return 0;
+	}
+	if (t < deadline) {
+		sleep_until(deadline);
+		deadline += period;
+		return 0;
+	}
+	int64_t missed = period > 0 ? (t - deadline)/period : 0;
+	if (policy == late_catchup)
+		deadline += period;
+	else
+		deadline += (missed + 1)*period;
+	return static_cast<int>(missed);
+}
+
+// std::chrono::steady_clock is CLOCK_MONOTONIC where clock_nanosleep exists
+int64_t flutter::frame_scheduler::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void flutter::frame_scheduler::sleep_until(int64_t t)
+{
+#ifdef CAN_CLOCK_NANOSLEEP
+	timespec ts;
+	ts.tv_sec = t/1000000000;
+	ts.tv_nsec = t%1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+#else
+	std::this_thread::sleep_until(std::chrono::steady_clock::time_point(
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::nanoseconds(t))));
+#endif
+}
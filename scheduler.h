@@ -0,0 +1,30 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "options.h"
+#include <cstdint>
+
+namespace flutter {
+
+// Paces frames on absolute deadlines of the monotonic clock, a period
+// apart, so that the time spent on a frame does not shift the following
+// ones and no GUI is needed to sleep.
+struct frame_scheduler {
+	int64_t period;
+	// deadline of the next frame, 0 before the first
+	int64_t deadline;
+	late_policy policy;
+
+	frame_scheduler(double fps, late_policy policy);
+	// Sleeps until the next deadline and returns the number of whole
+	// periods it had already passed by. Except when catching up, the
+	// following deadlines are moved to the next period after now.
+	int wait();
+	// monotonic time in nanoseconds
+	static int64_t now();
+	static void sleep_until(int64_t t);
+};
+
+}
+
+#endif // SCHEDULER_H
@@ -0,0 +1,78 @@
+// Reads the frames flutter publishes with --shm and reports how many were
+// received and missed and how old they were when read.
+
+#include "shm_ring.h"
+#include <opencv2/opencv.hpp>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+static int64_t now_ns()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char* argv[])
+{
+	const char* name = 0;
+	bool show = false;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--show"))
+			show = true;
+		else if (!name && argv[i][0] != '-')
+			name = argv[i];
+	}
+	if (!name) {
+		cerr << "usage: " << argv[0] << " <name> [--show]" << endl;
+		return 1;
+	}
+	flutter::shm_ring_reader ring;
+	// wait for the ring to be created
+	for (int i = 0; i < 100 && !ring.open(name); ++i)
+		this_thread::sleep_for(chrono::milliseconds(100));
+	if (!ring.is_open()) {
+		cerr << "unable to open ring " << name << endl;
+		return 1;
+	}
+	int64_t last = -1, received = 0, missed = 0, torn = 0;
+	double latency_ms = 0;
+	int64_t report = now_ns();
+	while (!ring.closed() || ring.latest() > last) {
+		int64_t latest = ring.latest();
+		if (latest <= last) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+		flutter::shm_frame f;
+		if (!ring.view(latest, f)) {
+			++torn;
+			continue;
+		}
+		latency_ms += (now_ns() - f.timestamp_ns)/1e6;
+		if (show) {
+			cv::imshow(name, f.image);
+			cv::waitKey(1);
+		}
+		// the view is only intact if the slot was not rewritten meanwhile
+		if (!ring.valid(f))
+			++torn;
+		if (last >= 0)
+			missed += latest - last - 1;
+		last = latest;
+		++received;
+		if (now_ns() - report > 1000000000) {
+			cout << "frame " << f.frame_no << ": " << received <<
+				" received, " << missed << " missed, " << torn <<
+				" torn, " << latency_ms/received << " ms latency" << endl;
+			report = now_ns();
+		}
+	}
+	cout << received << " received, " << missed << " missed, " << torn <<
+		" torn, " << (received ? latency_ms/received : 0) <<
+		" ms latency" << endl;
+	return 0;
+}
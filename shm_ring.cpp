@@ -0,0 +1,266 @@
+#include "shm_ring.h"
+#include "config.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#ifdef CAN_MMAP
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char shm_ring_magic[8] = {'F','L','U','T','S','H','M','1'};
+
+struct alignas(64) flutter::shm_ring::header {
+	char magic[8];
+	int32_t width;
+	int32_t height;
+	int32_t slots;
+	// set when the writer has closed the ring
+	std::atomic<int32_t> closed;
+	uint64_t step;
+	uint64_t slot_size;
+	// number of frames published, the latest has index published-1
+	std::atomic<int64_t> published;
+};
+
+// followed by the image, height rows of step bytes
+struct alignas(64) flutter::shm_ring::slot {
+	std::atomic<uint64_t> sequence;
+	int64_t frame_no;
+	int64_t timestamp_ns;
+	double warp[6];
+	double trajectory[9];
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+	"shared memory needs lock-free 64-bit atomics");
+
+static std::string shm_path(const std::string& name)
+{
+	return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+flutter::shm_ring::shm_ring():
+	data(0),
+	size(0)
+{
+}
+
+const flutter::shm_ring::header& flutter::shm_ring::head() const
+{
+	return *static_cast<const header*>(data);
+}
+
+std::size_t flutter::shm_ring::slot_size() const
+{
+	return head().slot_size;
+}
+
+flutter::shm_ring::slot* flutter::shm_ring::slot_at(int64_t index) const
+{
+	return reinterpret_cast<slot*>(static_cast<char*>(data) +
+		sizeof(header) + (index % head().slots)*slot_size());
+}
+
+flutter::shm_ring_writer::shm_ring_writer():
+	next(0)
+{
+}
+
+flutter::shm_ring_writer::~shm_ring_writer()
+{
+	close();
+}
+
+cv::Mat flutter::shm_ring_writer::begin()
+{
+	slot* s = slot_at(next);
+	s->sequence.store(2*next + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	return cv::Mat(head().height, head().width, CV_8UC3, s + 1, head().step);
+}
+
+void flutter::shm_ring_writer::commit(const shm_frame& f)
+{
+	slot* s = slot_at(next);
+	s->frame_no = f.frame_no;
+	s->timestamp_ns = f.timestamp_ns ? f.timestamp_ns :
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	std::copy(f.warp, f.warp + 6, s->warp);
+	std::copy(f.trajectory, f.trajectory + 9, s->trajectory);
+	s->sequence.store(2*(next + 1), std::memory_order_release);
+	++next;
+	static_cast<header*>(data)->published.store(next,
+		std::memory_order_release);
+}
+
+flutter::shm_ring_reader::shm_ring_reader()
+{
+}
+
+flutter::shm_ring_reader::~shm_ring_reader()
+{
+	close();
+}
+
+int64_t flutter::shm_ring_reader::latest() const
+{
+	return head().published.load(std::memory_order_acquire) - 1;
+}
+
+int64_t flutter::shm_ring_reader::oldest() const
+{
+	// the slot after the latest may be being written
+	return std::max<int64_t>(0, latest() - head().slots + 2);
+}
+
+bool flutter::shm_ring_reader::closed() const
+{
+	return head().closed.load(std::memory_order_acquire) != 0;
+}
+
+bool flutter::shm_ring_reader::view(int64_t index, shm_frame& f) const
+{
+	if (index < 0 || index > latest())
+		return false;
+	const slot* s = slot_at(index);
+	uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+	if (sequence != static_cast<uint64_t>(2*(index + 1)))
+		return false;
+	f.index = index;
+	f.frame_no = s->frame_no;
+	f.timestamp_ns = s->timestamp_ns;
+	std::copy(s->warp, s->warp + 6, f.warp);
+	std::copy(s->trajectory, s->trajectory + 9, f.trajectory);
+	f.image = cv::Mat(head().height, head().width, CV_8UC3,
+		const_cast<slot*>(s) + 1, head().step);
+	return valid(f);
+}
+
+bool flutter::shm_ring_reader::valid(const shm_frame& f) const
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot_at(f.index)->sequence.load(std::memory_order_relaxed) ==
+		static_cast<uint64_t>(2*(f.index + 1));
+}
+
+bool flutter::shm_ring_reader::read(int64_t index, shm_frame& f) const
+{
+	if (!view(index, f))
+		return false;
+	f.image = f.image.clone();
+	return valid(f);
+}
+
+#ifdef CAN_MMAP
+
+bool flutter::shm_ring_writer::open(const std::string& n, cv::Size frame,
+	int slots)
+{
+	close();
+	std::string path = shm_path(n);
+	shm_unlink(path.c_str());
+	int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return false;
+	std::size_t step = frame.width*3;
+	std::size_t slot_bytes = (sizeof(slot) + step*frame.height + 63)/64*64;
+	std::size_t new_size = sizeof(header) + slots*slot_bytes;
+	void* p = MAP_FAILED;
+	if (ftruncate(fd, new_size) == 0)
+		p = mmap(0, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(path.c_str());
+		return false;
+	}
+	data = p;
+	size = new_size;
+	name = path;
+	next = 0;
+	// the new object is zero filled, so all slots and counters are empty
+	header* h = static_cast<header*>(data);
+	h->width = frame.width;
+	h->height = frame.height;
+	h->slots = slots;
+	h->step = step;
+	h->slot_size = slot_bytes;
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(h->magic, shm_ring_magic, sizeof(shm_ring_magic));
+	return true;
+}
+
+void flutter::shm_ring_writer::close()
+{
+	if (data) {
+		static_cast<header*>(data)->closed.store(1,
+			std::memory_order_release);
+		munmap(data, size);
+		shm_unlink(name.c_str());
+	}
+	data = 0;
+	size = 0;
+	next = 0;
+}
+
+bool flutter::shm_ring_reader::open(const std::string& n)
+{
+	close();
+	int fd = shm_open(shm_path(n).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void* p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 &&
+			static_cast<std::size_t>(st.st_size) >= sizeof(header))
+		p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	data = p;
+	size = st.st_size;
+	const header& h = head();
+	bool valid = !std::memcmp(h.magic, shm_ring_magic,
+		sizeof(shm_ring_magic));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (!valid || h.slots <= 0 ||
+			size < sizeof(header) + h.slots*h.slot_size) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void flutter::shm_ring_reader::close()
+{
+	if (data)
+		munmap(data, size);
+	data = 0;
+	size = 0;
+}
+
+#else
+
+bool flutter::shm_ring_writer::open(const std::string&, cv::Size, int)
+{
+	return false;
+}
+
+void flutter::shm_ring_writer::close()
+{
+}
+
+bool flutter::shm_ring_reader::open(const std::string&)
+{
+	return false;
+}
+
+void flutter::shm_ring_reader::close()
+{
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace flutter {
+
+// A stabilized frame in a shared memory ring with its metadata.
+struct shm_frame {
+	// position of the frame in the ring's sequence of published frames
+	int64_t index;
+	int64_t frame_no;
+	// steady clock (CLOCK_MONOTONIC) time of publishing in nanoseconds
+	int64_t timestamp_ns;
+	// the 2x3 matrix the frame was warped with
+	double warp[6];
+	// sensor, camera and apparent (x, y, a) of the frame
+	double trajectory[9];
+	// BGR image, a view into the ring or a copy
+	cv::Mat image;
+};
+
+// Layout of the ring, shared by the writer and the readers: a header
+// followed by a fixed number of slots, each a slot header and the frame
+// data. Every slot is guarded by a sequence lock. The writer makes the
+// sequence of a slot odd while it writes and sets it to 2*(index+1)
+// afterwards, then publishes the index in the header. Readers check the
+// sequence before and after reading, so the writer never waits for
+// them and a slow reader only misses frames.
+struct shm_ring {
+	struct header;
+	struct slot;
+
+	void* data;
+	std::size_t size;
+
+	shm_ring();
+	std::size_t slot_size() const;
+	slot* slot_at(int64_t index) const;
+	const header& head() const;
+};
+
+// Publishes frames of a fixed size into a ring under a POSIX shared
+// memory name. The frame is rendered directly into the ring: begin()
+// returns the image of the next slot and commit() publishes it.
+struct shm_ring_writer: shm_ring {
+	std::string name;
+	int64_t next;
+
+	shm_ring_writer();
+	~shm_ring_writer();
+	shm_ring_writer(const shm_ring_writer&) = delete;
+	shm_ring_writer& operator=(const shm_ring_writer&) = delete;
+
+	// Creates the ring, replacing any earlier one of the name. Readers of
+	// the earlier ring keep their mapping. Returns false if the ring
+	// cannot be created or shared memory is not supported.
+	bool open(const std::string& name, cv::Size size, int slots);
+	bool is_open() const
+	{
+		return data != 0;
+	}
+	cv::Mat begin();
+	void commit(const shm_frame& f);
+	void close();
+};
+
+// Reads frames from a ring without ever blocking the writer. view()
+// returns the frame in place, which is only known to be intact if
+// valid() still holds after it has been used; read() copies it.
+struct shm_ring_reader: shm_ring {
+	shm_ring_reader();
+	~shm_ring_reader();
+	shm_ring_reader(const shm_ring_reader&) = delete;
+	shm_ring_reader& operator=(const shm_ring_reader&) = delete;
+
+	bool open(const std::string& name);
+	bool is_open() const
+	{
+		return data != 0;
+	}
+	// Index of the latest published frame, -1 if there is none.
+	int64_t latest() const;
+	// Oldest index that has not been overwritten yet.
+	int64_t oldest() const;
+	// Whether the writer has closed the ring.
+	bool closed() const;
+	bool view(int64_t index, shm_frame& f) const;
+	bool valid(const shm_frame& f) const;
+	bool read(int64_t index, shm_frame& f) const;
+	void close();
+};
+
+}
+
+#endif // SHM_RING_H
@@ -0,0 +1,558 @@
+#include "small_lk.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace cv;
+
+// fixed point bilinear weights and scale of the normal matrix, as in
+// calcOpticalFlowPyrLK
+static const int W_BITS = 14;
+static const float FLT_SCALE = 1.f/(1 << 20);
+static const float MIN_EIGEN_THRESHOLD = 1e-4f;
+static const float EPSILON = 0.01f;
+
+constexpr int flutter::small_lk::WINDOW;
+constexpr int flutter::small_lk::MAX_LEVELS;
+constexpr int flutter::small_lk::MAX_AREA;
+constexpr int flutter::small_lk::BORDER;
+
+flutter::lk_validation::lk_validation():
+	points(0),
+	compared(0),
+	status_mismatches(0),
+	sum_error(0),
+	max_error(0)
+{
+}
+
+flutter::small_lk::small_lk():
+	levels(0),
+	validate(false)
+{
+}
+
+bool flutter::small_lk::supports(Size size, int levels, Size window)
+{
+	return size.area() <= MAX_AREA && levels <= MAX_LEVELS &&
+		window == Size(WINDOW, WINDOW);
+}
+
+// Fills the border of a padded image whose interior is already set.
+static void fill_border(Mat& padded, int border)
+{
+	Mat interior = padded(Rect(border, border,
+		padded.cols - 2*border, padded.rows - 2*border));
+	copyMakeBorder(interior, padded, border, border, border, border,
+		BORDER_REFLECT_101 | BORDER_ISOLATED);
+}
+
+// Pyramid levels above the original, for at most max_levels, whose
+// images are larger than the window.
+static int fitting_levels(Size sz, int max_levels, int window)
+{
+	int levels = 0;
+	while (levels < max_levels) {
+		sz = Size((sz.width + 1)/2, (sz.height + 1)/2);
+		if (sz.width <= window || sz.height <= window)
+			break;
+		++levels;
+	}
+	return levels;
+}
+
+static void build_pyramid(const Mat& src, std::vector<Mat>& pyr, int levels,
+	int border)
+{
+	pyr.resize(levels + 1);
+	Size sz = src.size(), prev_sz;
+	for (int l = 0; l <= levels; ++l) {
+		if (l > 0) {
+			prev_sz = sz;
+			sz = Size((sz.width + 1)/2, (sz.height + 1)/2);
+		}
+		pyr[l].create(sz.height + 2*border, sz.width + 2*border, CV_8UC1);
+		Mat interior = pyr[l](Rect(border, border, sz.width, sz.height));
+		if (l == 0)
+			src.copyTo(interior);
+		else
+			pyrDown(pyr[l-1](Rect(Point(border, border), prev_sz)),
+				interior, sz);
+		fill_border(pyr[l], border);
+	}
+}
+
+// Column pass of the Scharr filter for the n pixels of row r1: the
+// smoothed sums 3*(r0 + r2) + 10*r1 and the differences r2 - r0, 8 at a
+// time where SSE2 or NEON is available.
+static void scharr_columns(const uchar* r0, const uchar* r1, const uchar* r2,
+	short* smooth, short* diff, int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i three = _mm_set1_epi16(3), ten = _mm_set1_epi16(10);
+	for (; x + 8 <= n; x += 8) {
+		__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(r0 + x)), zero);
+		__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(r1 + x)), zero);
+		__m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(r2 + x)), zero);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(smooth + x),
+			_mm_add_epi16(_mm_mullo_epi16(_mm_add_epi16(a, c), three),
+			_mm_mullo_epi16(b, ten)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(diff + x),
+			_mm_sub_epi16(c, a));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 8 <= n; x += 8) {
+		int16x8_t a = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(r0 + x)));
+		int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(r1 + x)));
+		int16x8_t c = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(r2 + x)));
+		vst1q_s16(smooth + x, vmlaq_n_s16(vmulq_n_s16(vaddq_s16(a, c), 3),
+			b, 10));
+		vst1q_s16(diff + x, vsubq_s16(c, a));
+	}
+#endif
+	for (; x < n; ++x) {
+		smooth[x] = 3*(r0[x] + r2[x]) + 10*r1[x];
+		diff[x] = r2[x] - r0[x];
+	}
+}
+
+// Row pass of the Scharr filter for n pixels, whose column sums start one
+// pixel before the first. Writes the interleaved x and y derivatives.
+static void scharr_rows(const short* smooth, const short* diff, short* d,
+	int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i three = _mm_set1_epi16(3), ten = _mm_set1_epi16(10);
+	for (; x + 8 <= n; x += 8) {
+		__m128i dx = _mm_sub_epi16(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(smooth + x + 2)),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(smooth + x)));
+		__m128i dm = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(diff + x));
+		__m128i dc = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(diff + x + 1));
+		__m128i dp = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(diff + x + 2));
+		__m128i dy = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_add_epi16(dm, dp), three),
+			_mm_mullo_epi16(dc, ten));
+		__m128i* p = reinterpret_cast<__m128i*>(d + 2*x);
+		_mm_storeu_si128(p, _mm_unpacklo_epi16(dx, dy));
+		_mm_storeu_si128(p + 1, _mm_unpackhi_epi16(dx, dy));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 8 <= n; x += 8) {
+		int16x8x2_t v;
+		v.val[0] = vsubq_s16(vld1q_s16(smooth + x + 2), vld1q_s16(smooth + x));
+		v.val[1] = vmlaq_n_s16(vmulq_n_s16(vaddq_s16(vld1q_s16(diff + x),
+			vld1q_s16(diff + x + 2)), 3), vld1q_s16(diff + x + 1), 10);
+		vst2q_s16(d + 2*x, v);
+	}
+#endif
+	for (; x < n; ++x) {
+		d[2*x] = smooth[x+2] - smooth[x];
+		d[2*x+1] = 3*(diff[x] + diff[x+2]) + 10*diff[x+1];
+	}
+}
+
+// Scharr gradients of the interior of a padded image. The interior is
+// filtered with the reflected border like calcOpticalFlowPyrLK does, and
+// the gradients are zero on the border, where calcOpticalFlowPyrLK pads
+// them with zeros. The windows of points near the edges of the small top
+// levels lie mostly on the border, so this matters. The columns are
+// filtered first so that both derivatives share the sums, which fit into
+// 16 bits for 8-bit images.
+static void scharr_gradients(const Mat& img, Mat& deriv, int border)
+{
+	int w = img.cols, h = img.rows, n = w - 2*border;
+	deriv.create(h, w, CV_16SC2);
+	deriv.setTo(Scalar::all(0));
+	AutoBuffer<short> smooth(n + 2), diff(n + 2);
+	for (int y = border; y < h-border; ++y) {
+		int x0 = border - 1;
+		scharr_columns(img.ptr<uchar>(y-1) + x0, img.ptr<uchar>(y) + x0,
+			img.ptr<uchar>(y+1) + x0, &smooth[0], &diff[0], n + 2);
+		scharr_rows(&smooth[0], &diff[0], deriv.ptr<short>(y) + 2*border, n);
+	}
+}
+
+int flutter::small_lk::build(const Mat& src1, const Mat& src2, int max_levels)
+{
+	CV_Assert(src1.type() == CV_8UC1 && src2.type() == CV_8UC1 &&
+		src1.size() == src2.size());
+	int fit = fitting_levels(src1.size(), MIN(max_levels, MAX_LEVELS), WINDOW);
+	if (src1.data == next_source.data && src1.size() == next_source.size() &&
+			fit == levels) {
+		std::swap(prev, next);
+		prev_source = next_source;
+	} else {
+		build_pyramid(src1, prev, fit, BORDER);
+		prev_source = src1;
+	}
+	levels = fit;
+	build_pyramid(src2, next, levels, BORDER);
+	next_source = src2;
+	deriv.resize(levels + 1);
+	for (int l = 0; l <= levels; ++l)
+		scharr_gradients(prev[l], deriv[l], BORDER);
+	return levels;
+}
+
+static inline int descale(int x, int n)
+{
+	return (x + (1 << (n - 1))) >> n;
+}
+
+// Fixed point weights of the four neighbours for the fractional position.
+static inline void bilinear_weights(Point2f f, int& w00, int& w01, int& w10,
+	int& w11)
+{
+	w00 = cvRound((1.f - f.x)*(1.f - f.y)*(1 << W_BITS));
+	w01 = cvRound(f.x*(1.f - f.y)*(1 << W_BITS));
+	w10 = cvRound((1.f - f.x)*f.y*(1 << W_BITS));
+	w11 = (1 << W_BITS) - w00 - w01 - w10;
+}
+
+// Bilinear interpolation of n pixels of the rows s0 and s1, scaled like
+// the Scharr gradients.
+static void interpolate_row(const uchar* s0, const uchar* s1, int w00,
+	int w01, int w10, int w11, short* dst, int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w0 = _mm_set1_epi32((w01 << 16) | w00);
+	const __m128i w1 = _mm_set1_epi32((w11 << 16) | w10);
+	const __m128i round = _mm_set1_epi32(1 << (W_BITS - 6));
+	for (; x + 8 <= n; x += 8) {
+		__m128i v00 = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(s0 + x)), zero);
+		__m128i v01 = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(s0 + x + 1)), zero);
+		__m128i v10 = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(s1 + x)), zero);
+		__m128i v11 = _mm_unpacklo_epi8(_mm_loadl_epi64(
+			reinterpret_cast<const __m128i*>(s1 + x + 1)), zero);
+		__m128i t0 = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpacklo_epi16(v00, v01), w0),
+			_mm_madd_epi16(_mm_unpacklo_epi16(v10, v11), w1));
+		__m128i t1 = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpackhi_epi16(v00, v01), w0),
+			_mm_madd_epi16(_mm_unpackhi_epi16(v10, v11), w1));
+		t0 = _mm_srai_epi32(_mm_add_epi32(t0, round), W_BITS - 5);
+		t1 = _mm_srai_epi32(_mm_add_epi32(t1, round), W_BITS - 5);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x),
+			_mm_packs_epi32(t0, t1));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 8 <= n; x += 8) {
+		int16x8_t v00 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(s0 + x)));
+		int16x8_t v01 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(s0 + x + 1)));
+		int16x8_t v10 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(s1 + x)));
+		int16x8_t v11 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(s1 + x + 1)));
+		int32x4_t t0 = vmull_n_s16(vget_low_s16(v00), w00);
+		t0 = vmlal_n_s16(t0, vget_low_s16(v01), w01);
+		t0 = vmlal_n_s16(t0, vget_low_s16(v10), w10);
+		t0 = vmlal_n_s16(t0, vget_low_s16(v11), w11);
+		int32x4_t t1 = vmull_n_s16(vget_high_s16(v00), w00);
+		t1 = vmlal_n_s16(t1, vget_high_s16(v01), w01);
+		t1 = vmlal_n_s16(t1, vget_high_s16(v10), w10);
+		t1 = vmlal_n_s16(t1, vget_high_s16(v11), w11);
+		vst1q_s16(dst + x, vcombine_s16(vrshrn_n_s32(t0, W_BITS - 5),
+			vrshrn_n_s32(t1, W_BITS - 5)));
+	}
+#endif
+	for (; x < n; ++x) {
+		dst[x] = descale(w00*s0[x] + w01*s0[x+1] + w10*s1[x] + w11*s1[x+1],
+			W_BITS - 5);
+	}
+}
+
+// Bilinear interpolation of n pixels of two rows of interleaved gradients.
+static void interpolate_gradient_row(const short* d0, const short* d1,
+	int w00, int w01, int w10, int w11, short* dst, int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i w0 = _mm_set1_epi32((w01 << 16) | w00);
+	const __m128i w1 = _mm_set1_epi32((w11 << 16) | w10);
+	const __m128i round = _mm_set1_epi32(1 << (W_BITS - 1));
+	for (; x + 4 <= n; x += 4) {
+		// the pairs of neighbours are the same component one pixel apart
+		__m128i v00 = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(d0 + 2*x));
+		__m128i v01 = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(d0 + 2*x + 2));
+		__m128i v10 = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(d1 + 2*x));
+		__m128i v11 = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(d1 + 2*x + 2));
+		__m128i t0 = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpacklo_epi16(v00, v01), w0),
+			_mm_madd_epi16(_mm_unpacklo_epi16(v10, v11), w1));
+		__m128i t1 = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpackhi_epi16(v00, v01), w0),
+			_mm_madd_epi16(_mm_unpackhi_epi16(v10, v11), w1));
+		t0 = _mm_srai_epi32(_mm_add_epi32(t0, round), W_BITS);
+		t1 = _mm_srai_epi32(_mm_add_epi32(t1, round), W_BITS);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2*x),
+			_mm_packs_epi32(t0, t1));
+	}
+#elif defined(__ARM_NEON)
+	for (; x + 4 <= n; x += 4) {
+		int16x4x2_t v00 = vld2_s16(d0 + 2*x), v01 = vld2_s16(d0 + 2*x + 2);
+		int16x4x2_t v10 = vld2_s16(d1 + 2*x), v11 = vld2_s16(d1 + 2*x + 2);
+		int16x4x2_t r;
+		for (int c = 0; c < 2; ++c) {
+			int32x4_t t = vmull_n_s16(v00.val[c], w00);
+			t = vmlal_n_s16(t, v01.val[c], w01);
+			t = vmlal_n_s16(t, v10.val[c], w10);
+			t = vmlal_n_s16(t, v11.val[c], w11);
+			r.val[c] = vrshrn_n_s32(t, W_BITS);
+		}
+		vst2_s16(dst + 2*x, r);
+	}
+#endif
+	for (; x < n; ++x) {
+		for (int c = 0; c < 2; ++c) {
+			dst[2*x+c] = descale(w00*d0[2*x+c] + w01*d0[2*x+c+2] +
+				w10*d1[2*x+c] + w11*d1[2*x+c+2], W_BITS);
+		}
+	}
+}
+
+#if defined(__ARM_NEON)
+static inline int64 sum_lanes(int32x4_t v)
+{
+	return static_cast<int64>(vgetq_lane_s32(v, 0)) + vgetq_lane_s32(v, 1) +
+		vgetq_lane_s32(v, 2) + vgetq_lane_s32(v, 3);
+}
+#endif
+
+// Sums of the products of the interleaved gradients of n pixels. The lanes
+// of the vector code hold at most n/2 products each, which for the window
+// sizes supported fit into 32 bits.
+static void gradient_products(const short* ixy, int n, int64& a11,
+	int64& a12, int64& a22)
+{
+	a11 = a12 = a22 = 0;
+	int x = 0;
+#if defined(__SSE2__)
+	__m128i sq = _mm_setzero_si128(), xy = _mm_setzero_si128();
+	for (; x + 4 <= n; x += 4) {
+		__m128i v = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(ixy + 2*x));
+		// dy, dx of each pixel
+		__m128i s = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v,
+			_MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+		__m128i lo = _mm_mullo_epi16(v, v), hi = _mm_mulhi_epi16(v, v);
+		sq = _mm_add_epi32(sq, _mm_add_epi32(_mm_unpacklo_epi16(lo, hi),
+			_mm_unpackhi_epi16(lo, hi)));
+		lo = _mm_mullo_epi16(v, s);
+		hi = _mm_mulhi_epi16(v, s);
+		xy = _mm_add_epi32(xy, _mm_add_epi32(_mm_unpacklo_epi16(lo, hi),
+			_mm_unpackhi_epi16(lo, hi)));
+	}
+	int CV_DECL_ALIGNED(16) q[8];
+	_mm_store_si128(reinterpret_cast<__m128i*>(q), sq);
+	_mm_store_si128(reinterpret_cast<__m128i*>(q + 4), xy);
+	a11 = static_cast<int64>(q[0]) + q[2];
+	a22 = static_cast<int64>(q[1]) + q[3];
+	a12 = static_cast<int64>(q[4]) + q[6];
+#elif defined(__ARM_NEON)
+	int32x4_t q11 = vdupq_n_s32(0), q12 = q11, q22 = q11;
+	for (; x + 4 <= n; x += 4) {
+		int16x4x2_t v = vld2_s16(ixy + 2*x);
+		q11 = vmlal_s16(q11, v.val[0], v.val[0]);
+		q12 = vmlal_s16(q12, v.val[0], v.val[1]);
+		q22 = vmlal_s16(q22, v.val[1], v.val[1]);
+	}
+	a11 = sum_lanes(q11);
+	a12 = sum_lanes(q12);
+	a22 = sum_lanes(q22);
+#endif
+	for (const short* p = ixy + 2*x; p < ixy + 2*n; p += 2) {
+		a11 += p[0]*p[0];
+		a12 += p[0]*p[1];
+		a22 += p[1]*p[1];
+	}
+}
+
+// Sums of the differences of the interpolated intensities j and i of n
+// pixels multiplied by the interleaved gradients, with 32-bit lanes like
+// gradient_products().
+static void mismatch_products(const short* j, const short* i,
+	const short* ixy, int n, int64& b1, int64& b2)
+{
+	b1 = b2 = 0;
+	int x = 0;
+#if defined(__SSE2__)
+	__m128i q = _mm_setzero_si128();
+	for (; x + 4 <= n; x += 4) {
+		__m128i d = _mm_sub_epi16(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(j + x)),
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(i + x)));
+		d = _mm_unpacklo_epi16(d, d);
+		__m128i v = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(ixy + 2*x));
+		__m128i lo = _mm_mullo_epi16(v, d), hi = _mm_mulhi_epi16(v, d);
+		q = _mm_add_epi32(q, _mm_add_epi32(_mm_unpacklo_epi16(lo, hi),
+			_mm_unpackhi_epi16(lo, hi)));
+	}
+	int CV_DECL_ALIGNED(16) s[4];
+	_mm_store_si128(reinterpret_cast<__m128i*>(s), q);
+	b1 = static_cast<int64>(s[0]) + s[2];
+	b2 = static_cast<int64>(s[1]) + s[3];
+#elif defined(__ARM_NEON)
+	int32x4_t q1 = vdupq_n_s32(0), q2 = q1;
+	for (; x + 4 <= n; x += 4) {
+		int16x4_t d = vsub_s16(vld1_s16(j + x), vld1_s16(i + x));
+		int16x4x2_t v = vld2_s16(ixy + 2*x);
+		q1 = vmlal_s16(q1, d, v.val[0]);
+		q2 = vmlal_s16(q2, d, v.val[1]);
+	}
+	b1 = sum_lanes(q1);
+	b2 = sum_lanes(q2);
+#endif
+	for (; x < n; ++x) {
+		int d = j[x] - i[x];
+		b1 += d*ixy[2*x];
+		b2 += d*ixy[2*x+1];
+	}
+}
+
+template <int WIN, int LEVELS>
+static void track_points(const std::vector<Mat>& prev,
+	const std::vector<Mat>& next, const std::vector<Mat>& deriv,
+	const Point2f* a, Point2f* b, uchar* status, int count,
+	int iterations, bool use_initial)
+{
+	const int B = flutter::small_lk::BORDER;
+	const float half = (WIN - 1)*0.5f;
+	// keeps the 32-bit lanes of the window sums from overflowing
+	static_assert(WIN*WIN <= 128, "window too large for 32-bit sums");
+
+	for (int i = 0; i < count; ++i) {
+		status[i] = 1;
+		Point2f next_pt;
+		for (int level = LEVELS; level >= 0; --level) {
+			const Mat& I = prev[level];
+			const Mat& J = next[level];
+			const Mat& D = deriv[level];
+			int cols = I.cols - 2*B, rows = I.rows - 2*B;
+			float s = 1.f/(1 << level);
+			if (level == LEVELS)
+				next_pt = (use_initial ? b[i] : a[i])*s;
+			else
+				next_pt = b[i]*2.f;
+			b[i] = next_pt;
+
+			Point2f prev_pt = a[i]*s - Point2f(half, half);
+			Point ip(cvFloor(prev_pt.x), cvFloor(prev_pt.y));
+			if (ip.x < -WIN || ip.x >= cols || ip.y < -WIN || ip.y >= rows) {
+				if (level == 0)
+					status[i] = 0;
+				continue;
+			}
+			int w00, w01, w10, w11;
+			bilinear_weights(prev_pt - Point2f(ip.x, ip.y),
+				w00, w01, w10, w11);
+
+			// intensities scaled like the Scharr gradients and the
+			// interleaved gradients of the window in I
+			short iw[WIN*WIN], ixy[2*WIN*WIN], jw[WIN*WIN];
+			for (int y = 0; y < WIN; ++y) {
+				const uchar* s0 = I.ptr<uchar>(ip.y + y + B) + ip.x + B;
+				const short* d0 = D.ptr<short>(ip.y + y + B) + 2*(ip.x + B);
+				interpolate_row(s0, s0 + I.step, w00, w01, w10, w11,
+					iw + y*WIN, WIN);
+				interpolate_gradient_row(d0, d0 + D.step/sizeof(short),
+					w00, w01, w10, w11, ixy + 2*y*WIN, WIN);
+			}
+			int64 s11, s12, s22;
+			gradient_products(ixy, WIN*WIN, s11, s12, s22);
+			float a11 = s11*FLT_SCALE;
+			float a12 = s12*FLT_SCALE;
+			float a22 = s22*FLT_SCALE;
+			float det = a11*a22 - a12*a12;
+			float min_eig = (a22 + a11 - std::sqrt((a11 - a22)*(a11 - a22) +
+				4.f*a12*a12))/(2*WIN*WIN);
+			if (min_eig < MIN_EIGEN_THRESHOLD || det < FLT_EPSILON) {
+				if (level == 0)
+					status[i] = 0;
+				continue;
+			}
+			det = 1.f/det;
+
+			next_pt -= Point2f(half, half);
+			Point2f prev_delta;
+			for (int j = 0; j < iterations; ++j) {
+				Point in(cvFloor(next_pt.x), cvFloor(next_pt.y));
+				if (in.x < -WIN || in.x >= cols || in.y < -WIN || in.y >= rows) {
+					if (level == 0)
+						status[i] = 0;
+					break;
+				}
+				bilinear_weights(next_pt - Point2f(in.x, in.y),
+					w00, w01, w10, w11);
+				for (int y = 0; y < WIN; ++y) {
+					const uchar* s0 = J.ptr<uchar>(in.y + y + B) + in.x + B;
+					interpolate_row(s0, s0 + J.step, w00, w01, w10, w11,
+						jw + y*WIN, WIN);
+				}
+				int64 t1, t2;
+				mismatch_products(jw, iw, ixy, WIN*WIN, t1, t2);
+				float b1 = t1*FLT_SCALE;
+				float b2 = t2*FLT_SCALE;
+				Point2f delta((a12*b2 - a22*b1)*det, (a12*b1 - a11*b2)*det);
+				next_pt += delta;
+				b[i] = next_pt + Point2f(half, half);
+				if (delta.ddot(delta) <= EPSILON*EPSILON)
+					break;
+				if (j > 0 && std::abs(delta.x + prev_delta.x) < 0.01 &&
+						std::abs(delta.y + prev_delta.y) < 0.01) {
+					b[i] -= delta*0.5f;
+					break;
+				}
+				prev_delta = delta;
+			}
+		}
+	}
+}
+
+void flutter::small_lk::track(const Point2f* a, Point2f* b, uchar* status,
+	int count, int iterations, bool use_initial) const
+{
+	switch (levels) {
+	case 0:
+		track_points<WINDOW, 0>(prev, next, deriv, a, b, status, count,
+			iterations, use_initial);
+		break;
+	case 1:
+		track_points<WINDOW, 1>(prev, next, deriv, a, b, status, count,
+			iterations, use_initial);
+		break;
+	case 2:
+		track_points<WINDOW, 2>(prev, next, deriv, a, b, status, count,
+			iterations, use_initial);
+		break;
+	case 3:
+		track_points<WINDOW, 3>(prev, next, deriv, a, b, status, count,
+			iterations, use_initial);
+		break;
+	default:
+		CV_Error(CV_StsOutOfRange, "Unsupported number of pyramid levels");
+	}
+}
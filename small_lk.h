@@ -0,0 +1,61 @@
+#ifndef SMALL_LK_H
+#define SMALL_LK_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+namespace flutter {
+
+// Differences between the small LK tracker and calcOpticalFlowPyrLK for
+// the same points, in pixels of the tracked images.
+struct lk_validation {
+	long points;
+	// points found by both, over which the errors are taken
+	long compared;
+	long status_mismatches;
+	double sum_error;
+	double max_error;
+
+	lk_validation();
+};
+
+// Pyramidal Lucas-Kanade optical flow for the downscaled gray images of
+// registration, following calcOpticalFlowPyrLK with a fixed window size
+// and level count so that the per-point loops have constant bounds. The
+// padded pyramids and the Scharr gradients are computed once per image
+// and are small enough to stay in the cache; the pyramid of the second
+// image is reused when it is the first image of the next call. The
+// gradients and the window sums use SSE2 or NEON where available, with
+// exact integer sums.
+struct small_lk {
+	static constexpr int WINDOW = 10;
+	static constexpr int MAX_LEVELS = 3;
+	static constexpr int MAX_AREA = 320*240;
+	static constexpr int BORDER = WINDOW + 1;
+
+	std::vector<cv::Mat> prev;
+	std::vector<cv::Mat> next;
+	// CV_16SC2 Scharr gradients of prev
+	std::vector<cv::Mat> deriv;
+	cv::Mat prev_source;
+	cv::Mat next_source;
+	int levels;
+	// Also run calcOpticalFlowPyrLK and record the differences.
+	bool validate;
+	lk_validation validation;
+
+	small_lk();
+	static bool supports(cv::Size size, int levels, cv::Size window);
+	// Builds the pyramids of two 8-bit gray images of the same size and
+	// returns the number of levels above the original that fit.
+	int build(const cv::Mat& src1, const cv::Mat& src2, int levels);
+	// Tracks the points a of the first image to b in the second, with b
+	// as the initial estimate if use_initial is set. Distinct ranges of
+	// points may be tracked concurrently.
+	void track(const cv::Point2f* a, cv::Point2f* b, uchar* status,
+		int count, int iterations, bool use_initial) const;
+};
+
+}
+
+#endif // SMALL_LK_H
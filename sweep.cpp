@@ -0,0 +1,120 @@
+#include "sweep.h"
+#include "delta_filter.h"
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+template <typename T>
+static void filter_camera(const vector<Transform<T>>& sensor,
+	const vector<T>& periods, Size size,
+	const flutter::smoothing_params& params, vector<Transform<T>>& camera)
+{
+	typedef Transform<T> transform_t;
+	KalmanFilter filter(3, 3, 0, opencv_traits<T>::type);
+	flutter::init_delta_filter<T>(filter, size,
+		params.process_error, params.measurement_error);
+	Mat process_noise = filter.processNoiseCov.clone();
+	camera.assign(sensor.size(), transform_t());
+	for (size_t i = 1; i < sensor.size(); ++i) {
+		T r = periods[i];
+		process_noise.convertTo(filter.processNoiseCov, -1, r);
+		filter.predict();
+		typename transform_t::vec_type delta =
+			sensor[i].compose(sensor[i-1].inverse()).toVec()*(1/r);
+		camera[i] = (transform_t::fromVec(
+			filter.correct(Mat(delta, false)))*r).compose(camera[i-1]);
+	}
+}
+
+// The apparent transformation shown with each frame. The moving average
+// is padded with the identity before the first frame and with the last
+// camera transformation after the last frame as in the real output.
+template <typename T>
+static void filter_apparent(const vector<Transform<T>>& camera,
+	const vector<T>& periods, const flutter::smoothing_params& params,
+	vector<Transform<T>>& apparent)
+{
+	typedef Transform<T> transform_t;
+	int n = camera.size();
+	apparent.assign(n, transform_t());
+	if (!params.avg_window) {
+		for (int i = 1; i < n; ++i) {
+			apparent[i] = apparent[i-1] +
+				flutter::low_pass_weight(params.low_pass, periods[i]) *
+				(camera[i] - apparent[i-1]);
+		}
+		return;
+	}
+	int window = params.avg_window;
+	auto at = [&](int j) {
+		if (j < 0)
+			return transform_t();
+		return camera[min(j, n-1)];
+	};
+	transform_t sum;
+	for (int j = window/2 - window + 1; j <= window/2; ++j)
+		sum += at(j);
+	for (int i = 0; i < n; ++i) {
+		apparent[i] = sum / window;
+		sum += at(i + window/2 + 1) - at(i + window/2 - window + 1);
+	}
+}
+
+// Smallest zoom around the center for which the corrected frame covers
+// the whole output.
+template <typename T>
+static double required_zoom(const Transform<T>& t, Size size)
+{
+	double w = size.width/2.0, h = size.height/2.0;
+	double ca = t.c, sa = t.s;
+	// source position of the output center
+	double cx = w - t.x, cy = h - t.y;
+	double dx = ca*cx + sa*cy - w;
+	double dy = -sa*cx + ca*cy - h;
+	double vx = abs(ca)*w + abs(sa)*h;
+	double vy = abs(sa)*w + abs(ca)*h;
+	if (abs(dx) >= w || abs(dy) >= h)
+		return numeric_limits<double>::infinity();
+	return max({1.0, vx/(w - abs(dx)), vy/(h - abs(dy))});
+}
+
+template <typename T>
+flutter::smoothing_score flutter::evaluate_smoothing(
+	const vector<Transform<T>>& sensor, const vector<T>& periods, Size size,
+	const smoothing_params& params)
+{
+	typedef Transform<T> transform_t;
+	vector<transform_t> camera, apparent;
+	filter_camera(sensor, periods, size, params, camera);
+	filter_apparent(camera, periods, params, apparent);
+
+	smoothing_score score = {0.0, 1.0, 0.0};
+	double radius = hypot(size.width, size.height)/2;
+	transform_t prev;
+	for (size_t i = 0; i < sensor.size(); ++i) {
+		transform_t correction = apparent[i].compose(camera[i].inverse());
+		transform_t stabilized = correction.compose(sensor[i]);
+		if (i > 0) {
+			transform_t d = stabilized.compose(prev.inverse());
+			double r = d.a*radius;
+			score.jitter += d.x*d.x + d.y*d.y + r*r;
+		}
+		prev = stabilized;
+		score.max_zoom = max(score.max_zoom,
+			required_zoom(correction, size));
+	}
+	if (sensor.size() > 1)
+		score.jitter /= sensor.size() - 1;
+	score.border_loss = 1 - 1/(score.max_zoom*score.max_zoom);
+	return score;
+}
+
+template flutter::smoothing_score flutter::evaluate_smoothing(
+	const vector<Transform<float>>&, const vector<float>&, Size,
+	const smoothing_params&);
+template flutter::smoothing_score flutter::evaluate_smoothing(
+	const vector<Transform<double>>&, const vector<double>&, Size,
+	const smoothing_params&);
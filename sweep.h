@@ -0,0 +1,38 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "transform.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+namespace flutter {
+
+struct smoothing_params {
+	double process_error;
+	double measurement_error;
+	double low_pass;
+	int avg_window;
+};
+
+struct smoothing_score {
+	// Mean squared frame to frame motion of the stabilized path in
+	// pixels, the rotation measured at the corners of the frame.
+	double jitter;
+	// Zoom needed to keep the borders out of every frame and the
+	// fraction of the frame area cropped by it.
+	double max_zoom;
+	double border_loss;
+};
+
+// Filters the sensor path, given as the accumulated sensor transformation
+// of each frame and the time since the previous frame in frame periods,
+// as a run with the parameters would and scores the result without
+// warping any frames.
+template <typename T>
+smoothing_score evaluate_smoothing(const std::vector<Transform<T>>& sensor,
+	const std::vector<T>& periods, cv::Size size,
+	const smoothing_params& params);
+
+}
+
+#endif // SWEEP_H
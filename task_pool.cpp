@@ -0,0 +1,90 @@
+#include "task_pool.h"
+
+static thread_local bool in_task = false;
+
+flutter::task_pool::task_pool(int threads):
+	job(0),
+	job_size(0),
+	next(0),
+	pending(0),
+	generation(0),
+	stopping(false)
+{
+	if (threads <= 0)
+		threads = std::thread::hardware_concurrency();
+	for (int i = 1; i < threads; ++i)
+		workers.emplace_back(&task_pool::work, this);
+}
+
+flutter::task_pool::~task_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t: workers)
+		t.join();
+}
+
+void flutter::task_pool::run(const std::function<void(int)>& f, int n)
+{
+	in_task = true;
+	try {
+		for (int i; (i = next++) < n;)
+			f(i);
+	} catch (...) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!error)
+			error = std::current_exception();
+		next = n;
+	}
+	in_task = false;
+}
+
+void flutter::task_pool::work()
+{
+	unsigned seen = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wake.wait(lock, [&] { return stopping || generation != seen; });
+		if (stopping)
+			return;
+		seen = generation;
+		const std::function<void(int)>& f = *job;
+		int n = job_size;
+		lock.unlock();
+		run(f, n);
+		lock.lock();
+		if (--pending == 0)
+			done.notify_all();
+	}
+}
+
+void flutter::task_pool::parallel_for(int n, const std::function<void(int)>& f)
+{
+	if (workers.empty() || n <= 1 || in_task) {
+		for (int i = 0; i < n; ++i)
+			f(i);
+		return;
+	}
+	std::lock_guard<std::mutex> submit_lock(submit);
+	std::unique_lock<std::mutex> lock(mutex);
+	job = &f;
+	job_size = n;
+	next = 0;
+	pending = workers.size();
+	error = std::exception_ptr();
+	++generation;
+	lock.unlock();
+	wake.notify_all();
+	run(f, n);
+	lock.lock();
+	done.wait(lock, [&] { return pending == 0; });
+	job = 0;
+	std::exception_ptr e = error;
+	error = std::exception_ptr();
+	lock.unlock();
+	if (e)
+		std::rethrow_exception(e);
+}
@@ -0,0 +1,52 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace flutter {
+
+// A fixed set of worker threads shared by the stages of the pipeline.
+struct task_pool {
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::mutex submit;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int)>* job;
+	int job_size;
+	std::atomic<int> next;
+	int pending;
+	unsigned generation;
+	bool stopping;
+	std::exception_ptr error;
+
+	// The calling thread takes part in the work, so threads-1 workers are
+	// started. Zero threads means one per hardware thread.
+	explicit task_pool(int threads = 0);
+	~task_pool();
+	task_pool(const task_pool&) = delete;
+	task_pool& operator=(const task_pool&) = delete;
+
+	// Number of threads that take part in parallel_for.
+	int size() const
+	{
+		return workers.size() + 1;
+	}
+
+	// Calls f(i) for each i in [0, n) and returns when all calls have
+	// finished. Calls made from within a task run serially.
+	void parallel_for(int n, const std::function<void(int)>& f);
+
+	void work();
+	void run(const std::function<void(int)>& f, int n);
+};
+
+}
+
+#endif // TASK_POOL_H
@@ -0,0 +1,131 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "transform.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+namespace flutter {
+
+template <typename T>
+struct trajectory_entry {
+	// number of the frame in the input, -1 for frames without one
+	int frame;
+	Transform<T> sensor;
+	Transform<T> camera;
+	Transform<T> apparent;
+};
+
+// The binary trajectory format starts with the magic string followed by
+// records of a 32-bit frame number and the sensor, camera and apparent
+// transformations as doubles (x, y, a), all in native byte order.
+static constexpr char trajectory_magic[8] = {'F','L','U','T','T','R','J','1'};
+
+inline void write_binary_trajectory_header(std::ostream& o)
+{
+	o.write(trajectory_magic, sizeof(trajectory_magic));
+}
+
+template <typename T>
+void write_binary_trajectory_entry(std::ostream& o, int frame,
+	const Transform<T>& sensor, const Transform<T>& camera,
+	const Transform<T>& apparent)
+{
+	int32_t f = frame;
+	double v[9] = {
+		sensor.x, sensor.y, sensor.a,
+		camera.x, camera.y, camera.a,
+		apparent.x, apparent.y, apparent.a
+	};
+	o.write(reinterpret_cast<const char*>(&f), sizeof(f));
+	o.write(reinterpret_cast<const char*>(v), sizeof(v));
+}
+
+template <typename T>
+bool read_binary_trajectory(std::istream& in,
+	std::vector<trajectory_entry<T>>& entries)
+{
+	char magic[sizeof(trajectory_magic)];
+	if (!in.read(magic, sizeof(magic)) ||
+			std::memcmp(magic, trajectory_magic, sizeof(magic)))
+		return false;
+	int32_t f;
+	double v[9];
+	while (in.read(reinterpret_cast<char*>(&f), sizeof(f)) &&
+			in.read(reinterpret_cast<char*>(v), sizeof(v))) {
+		trajectory_entry<T> e;
+		e.frame = f;
+		e.sensor = Transform<T>(v[0], v[1], v[2]);
+		e.camera = Transform<T>(v[3], v[4], v[5]);
+		e.apparent = Transform<T>(v[6], v[7], v[8]);
+		entries.push_back(e);
+	}
+	return in.eof();
+}
+
+// Reads tab-separated values as written with -t. The columns are
+// identified by the header.
+template <typename T>
+bool read_tsv_trajectory(std::istream& in,
+	std::vector<trajectory_entry<T>>& entries)
+{
+	static char const* const names[10] = {
+		"frame",
+		"sensor_x", "sensor_y", "sensor_a",
+		"camera_x", "camera_y", "camera_a",
+		"apparent_x", "apparent_y", "apparent_a"
+	};
+	std::string line, name;
+	if (!std::getline(in, line))
+		return false;
+	std::vector<int> column(10, -1);
+	std::istringstream header(line);
+	for (int i = 0; std::getline(header, name, '\t'); ++i) {
+		for (int j = 0; j < 10; ++j) {
+			if (name == names[j])
+				column[j] = i;
+		}
+	}
+	for (int c: column) {
+		if (c < 0)
+			return false;
+	}
+	std::vector<double> values;
+	while (std::getline(in, line)) {
+		if (line.empty())
+			continue;
+		values.clear();
+		std::istringstream row(line);
+		std::string value;
+		while (std::getline(row, value, '\t'))
+			values.push_back(std::strtod(value.c_str(), 0));
+		trajectory_entry<T> e;
+		auto v = [&](int j) {
+			return column[j] < (int)values.size() ?
+				values[column[j]] : 0.0;
+		};
+		e.frame = v(0);
+		e.sensor = Transform<T>(v(1), v(2), v(3));
+		e.camera = Transform<T>(v(4), v(5), v(6));
+		e.apparent = Transform<T>(v(7), v(8), v(9));
+		entries.push_back(e);
+	}
+	return true;
+}
+
+template <typename T>
+bool read_trajectory(std::istream& in, std::vector<trajectory_entry<T>>& entries)
+{
+	if (in.peek() == trajectory_magic[0])
+		return read_binary_trajectory(in, entries);
+	return read_tsv_trajectory(in, entries);
+}
+
+}
+
+#endif // TRAJECTORY_H
@@ -5,77 +5,191 @@
 #include <iostream>
 #include <cmath>
 
+template <typename T>
+struct opencv_traits {};
+
+template <>
+struct opencv_traits<float>
+{
+	static constexpr int type = CV_32FC1;
+};
+
+template <>
+struct opencv_traits<double>
+{
+	static constexpr int type = CV_64FC1;
+};
+
+// A similarity transformation with the rotation cached as cosine and sine,
+// so that composition and the matrix need no trigonometry. The scale is
+// optional and 1 unless taken from a similarity matrix. The arithmetic
+// operators treat (x, y, a) as a vector for filtering, compose() and
+// inverse() are the group operations for accumulating motion.
+//
+// All conversions use fixed size matrices so that the per-frame transform
+// math does not touch the heap.
 template <typename T>
 struct Transform {
+	typedef T value_type;
+	typedef cv::Matx<T,2,3> affine_type;
+	typedef cv::Matx<T,3,1> vec_type;
 	T x;
 	T y;
 	T a;
-	Transform() : x(0.0), y(0.0), a(0.0) {}
-	Transform(T x, T y, T a) : x(x), y(y), a(a) {}
-	// convert affine transformation matrix
-	Transform(const cv::Mat& m):
-		x(m.at<T>(0,2)),
-		y(m.at<T>(1,2)),
-		a(atan2(m.at<T>(1,0), m.at<T>(0.0)))
+	T k;
+	T c;
+	T s;
+	constexpr Transform() : x(0.0), y(0.0), a(0.0), k(1.0), c(1.0), s(0.0) {}
+	Transform(T x, T y, T a, T k = 1):
+		x(x), y(y), a(a), k(k), c(std::cos(a)), s(std::sin(a))
+	{
+	}
+	constexpr Transform(T x, T y, T a, T k, T c, T s):
+		x(x), y(y), a(a), k(k), c(c), s(s)
+	{
+	}
+	// convert affine transformation matrix, dropping the scale
+	explicit Transform(const affine_type& m)
+	{
+		set(m(0,0), m(1,0), m(0,2), m(1,2));
+		k = 1;
+	}
+	// convert affine transformation matrix of either floating point
+	// type, dropping the scale
+	explicit Transform(const cv::Mat& m)
+	{
+		set(element(m,0,0), element(m,1,0), element(m,0,2), element(m,1,2));
+		k = 1;
+	}
+	static Transform similarity(const cv::Mat& m)
 	{
+		Transform t;
+		t.set(element(m,0,0), element(m,1,0), element(m,0,2), element(m,1,2));
+		return t;
 	}
-	Transform& operator+=(const Transform& t)
+	constexpr Transform& operator+=(const Transform& t)
 	{
-		//x += t.x * cos(a) - t.y * sin(a);
-		//y += t.x * sin(a) + t.y * cos(a);
+		T c2 = c*t.c - s*t.s;
+		s = s*t.c + c*t.s;
+		c = c2;
 		x += t.x;
 		y += t.y;
 		a += t.a;
+		k *= t.k;
 		return *this;
 	}
-	Transform operator+(const Transform& t) const
+	constexpr Transform operator+(const Transform& t) const
 	{
 		Transform r(*this);
 		r += t;
 		return r;
 	}
-	Transform operator-() const
+	constexpr Transform operator-() const
 	{
-		return Transform(-x, -y, -a);
+		return Transform(-x, -y, -a, 1/k, c, -s);
 	}
-	Transform operator-(const Transform& t) const
+	constexpr Transform operator-(const Transform& t) const
 	{
 		return *this + -t;
 	}
-	Transform& operator-=(const Transform& t)
+	constexpr Transform& operator-=(const Transform& t)
 	{
 		return *this += -t;
 	}
-	Transform operator*(T c) const
+	Transform operator*(T f) const
 	{
-		return Transform(c*x, c*y, c*a);
+		return Transform(f*x, f*y, f*a, std::pow(k, f));
 	}
-	Transform operator/(T c) const
+	Transform operator/(T f) const
 	{
-		return Transform(x/c, y/c, a/c);
+		return *this * (1/f);
 	}
-	cv::Mat toMat() const
+	// The transformation that applies t first and then this one.
+	constexpr Transform compose(const Transform& t) const
 	{
-		return cv::Mat_<T>(2,3) <<
-			cos(a), -sin(a), x,
-			sin(a),  cos(a), y;
+		return Transform(
+			k*(c*t.x - s*t.y) + x,
+			k*(s*t.x + c*t.y) + y,
+			a + t.a,
+			k*t.k,
+			c*t.c - s*t.s,
+			s*t.c + c*t.s);
 	}
-	cv::Mat toVec() const
+	constexpr Transform inverse() const
 	{
-		return cv::Mat_<T>(3,1) << x, y, a;
+		return Transform(
+			-(c*x + s*y)/k,
+			(s*x - c*y)/k,
+			-a,
+			1/k,
+			c,
+			-s);
+	}
+	affine_type toMat() const
+	{
+		return affine_type(
+			k*c, -k*s, x,
+			k*s,  k*c, y);
+	}
+	vec_type toVec() const
+	{
+		return vec_type(x, y, a);
 	}
 	T abs() const
 	{
 		return sqrt(x*x+y*y+a*a);
 	}
+	// The state vectors of the Kalman filter are used in place.
 	static Transform fromVec(const cv::Mat& m)
 	{
 		return Transform(m.at<T>(0),m.at<T>(1),m.at<T>(2));
 	}
+	static Transform fromVec(const vec_type& v)
+	{
+		return Transform(v(0),v(1),v(2));
+	}
+	static T element(const cv::Mat& m, int i, int j)
+	{
+		return m.depth() == CV_32F ? m.at<float>(i,j) : m.at<double>(i,j);
+	}
+	void set(T m00, T m10, T m02, T m12)
+	{
+		x = m02;
+		y = m12;
+		a = std::atan2(m10, m00);
+		k = std::hypot(m00, m10);
+		c = k > 0 ? m00/k : 1;
+		s = k > 0 ? m10/k : 0;
+	}
 };
 
+// The matrix that warps a frame of in_size by t into out_size, zoomed by
+// the given factor around the center of the output if it is positive.
+template <typename T>
+cv::Matx<T,2,3> warp_matrix(const Transform<T>& t, cv::Size in_size,
+	cv::Size out_size, double zoom)
+{
+	cv::Matx<T,2,3> m = t.toMat();
+	T scale_x = static_cast<T>(out_size.width) / in_size.width;
+	T scale_y = static_cast<T>(out_size.height) / in_size.height;
+	for (int j = 0; j < 3; ++j) {
+		m(0,j) *= scale_x;
+		m(1,j) *= scale_y;
+	}
+	if (zoom > 0.0) {
+		T z = zoom;
+		T w = out_size.width/2;
+		T h = out_size.height/2;
+		m *= z;
+		m(0,2) += w*(1-z);
+		m(1,2) += h*(1-z);
+	}
+	return m;
+}
+
 template <typename T>
-Transform<T> operator*(T c, const Transform<T>& t)
+Transform<T> operator*(typename Transform<T>::value_type c,
+	const Transform<T>& t)
 {
 	return t*c;
 }
@@ -0,0 +1,51 @@
+#include "warp.h"
+#include <opencv2/opencv.hpp>
+
+using namespace cv;
+
+flutter::yuv420_planes::yuv420_planes(const Mat& i420)
+{
+	CV_Assert(i420.type() == CV_8UC1 && i420.isContinuous());
+	CV_Assert(i420.cols % 2 == 0 && i420.rows % 3 == 0);
+	int w = i420.cols;
+	int h = i420.rows*2/3;
+	uchar* data = const_cast<uchar*>(i420.ptr());
+	y = Mat(h, w, CV_8UC1, data);
+	u = Mat(h/2, w/2, CV_8UC1, data + w*h);
+	v = Mat(h/2, w/2, CV_8UC1, data + w*h + (w/2)*(h/2));
+}
+
+flutter::yuv420_planes flutter::yuv420_planes::operator()(const Rect& r) const
+{
+	Rect c(r.x/2, r.y/2, r.width/2, r.height/2);
+	yuv420_planes p;
+	p.y = y(r);
+	p.u = u(c);
+	p.v = v(c);
+	return p;
+}
+
+void flutter::warp_affine_yuv420(const yuv420_planes& src, yuv420_planes& dst,
+	InputArray M, int flags)
+{
+	Mat_<double> luma;
+	M.getMat().convertTo(luma, CV_64F);
+	// Chroma sample (x, y) is centered at luma (2x+0.5, 2y+0.5)
+	Mat_<double> chroma = luma.clone();
+	chroma(0,2) = (luma(0,2) + 0.5*(luma(0,0) + luma(0,1)) - 0.5) / 2;
+	chroma(1,2) = (luma(1,2) + 0.5*(luma(1,0) + luma(1,1)) - 0.5) / 2;
+	warpAffine(src.y, dst.y, luma, dst.y.size(), flags,
+		BORDER_CONSTANT, Scalar(0));
+	// zero chroma would be green, use neutral gray for the borders
+	warpAffine(src.u, dst.u, chroma, dst.u.size(), flags,
+		BORDER_CONSTANT, Scalar(128));
+	warpAffine(src.v, dst.v, chroma, dst.v.size(), flags,
+		BORDER_CONSTANT, Scalar(128));
+}
+
+void flutter::resize_yuv420(const yuv420_planes& src, yuv420_planes& dst)
+{
+	resize(src.y, dst.y, dst.y.size());
+	resize(src.u, dst.u, dst.u.size());
+	resize(src.v, dst.v, dst.v.size());
+}
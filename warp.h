@@ -0,0 +1,37 @@
+#ifndef WARP_H
+#define WARP_H
+
+#include <opencv2/opencv.hpp>
+
+namespace flutter {
+
+// Views to the planes of a planar YUV 4:2:0 (I420) image. The luma
+// plane has the full size and the chroma planes have half the width and
+// half the height.
+struct yuv420_planes {
+	cv::Mat y;
+	cv::Mat u;
+	cv::Mat v;
+
+	yuv420_planes() {}
+	// i420 is a single channel image with height*3/2 rows, as produced
+	// by cvtColor(src, i420, CV_BGR2YUV_I420)
+	explicit yuv420_planes(const cv::Mat& i420);
+	// sub-view, r is given in luma coordinates and should be even
+	yuv420_planes operator()(const cv::Rect& r) const;
+	cv::Size size() const
+	{
+		return y.size();
+	}
+};
+
+// Warps the luma plane with the affine transformation M and the chroma
+// planes with the same transformation scaled to the chroma resolution.
+void warp_affine_yuv420(const yuv420_planes& src, yuv420_planes& dst,
+	cv::InputArray M, int flags = cv::INTER_LINEAR);
+
+void resize_yuv420(const yuv420_planes& src, yuv420_planes& dst);
+
+}
+
+#endif // WARP_H